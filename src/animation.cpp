@@ -0,0 +1,154 @@
+#include "animation.hpp"
+#include "utils.hpp"
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+#include <cctype>
+
+template <class T>
+void Animation::Track<T>::add(real frame, const T &value) {
+	auto it = std::upper_bound(keys.begin(), keys.end(), frame, [](real f, const std::pair<real, T> &key) {
+		return f < key.first;
+	});
+	keys.insert(it, std::make_pair(frame, value));
+}
+
+template <class T>
+T Animation::Track<T>::at(real frame) const {
+	if (frame <= keys.front().first)
+		return keys.front().second;
+	if (frame >= keys.back().first)
+		return keys.back().second;
+	// First keyframe after frame, then interpolate with the previous one
+	auto it = std::upper_bound(keys.begin(), keys.end(), frame, [](real f, const std::pair<real, T> &key) {
+		return f < key.first;
+	});
+	const std::pair<real, T> &a = *(it - 1), &b = *it;
+	real s = (frame - a.first) / (b.first - a.first);
+	return a.second + s * (b.second - a.second);
+}
+
+bool Animation::load(const std::string &path) {
+	file = path;
+	std::ifstream spec(path);
+	if (!spec) {
+		ErrorMessage() << "cannot open animation file " << path;
+		return false;
+	}
+	std::string line;
+	unsigned n_line = 0;
+	while (getline(spec, line)) {
+		++n_line;
+		if (line.empty() || line[0] == '#') // Skip empty and commentary lines
+			continue;
+		std::stringstream s(line.substr(1));
+		double frame, x, y, z, value;
+		int key;
+		bool ok;
+		switch (line[0]) {
+		case 'C': // Camera position
+			ok = (bool) (s >> frame >> x >> y >> z);
+			if (ok)
+				camera.add(frame, Vector(x, y, z));
+			break;
+		case 'L': // Light position and intensity
+			ok = (bool) (s >> frame >> x >> y >> z >> value);
+			if (ok) {
+				light_position.add(frame, Vector(x, y, z));
+				light_intensity.add(frame, value);
+			}
+			break;
+		case 'S': // Origin and radius of a sphere
+			ok = (bool) (s >> frame >> key >> x >> y >> z >> value) && key >= 0 && value > 0;
+			if (ok) {
+				spheres[key].origin.add(frame, Vector(x, y, z));
+				spheres[key].radius.add(frame, value);
+			}
+			break;
+		default:
+			ok = false;
+		}
+		if (!ok) {
+			ErrorMessage() << "parsing error at line " << n_line << " of file " << path;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Animation::bind(const Scene &scene) {
+	for (int i = 0; i < scene.sphereCount(); i++) {
+		auto it = spheres.find(scene.sphereKey(i));
+		if (it != spheres.end())
+			it->second.index = i;
+	}
+	for (const std::pair<const int, SphereTrack> &sphere : spheres)
+		if (sphere.second.index < 0) {
+			ErrorMessage() << "sphere " << sphere.first << " animated in file " << file
+						   << " is not in the scene (or was converted to a plane)";
+			return false;
+		}
+	return true;
+}
+
+int Animation::frameCount() const {
+	real last = 0;
+	if (!camera.keys.empty())
+		last = std::max(last, camera.keys.back().first);
+	if (!light_position.keys.empty())
+		last = std::max(last, light_position.keys.back().first);
+	for (const std::pair<const int, SphereTrack> &sphere : spheres)
+		last = std::max(last, sphere.second.origin.keys.back().first);
+	return (int) last + 1;
+}
+
+bool Animation::apply(real frame, Scene &scene, Vector &camera_position) const {
+	if (!camera.keys.empty())
+		camera_position = camera.at(frame);
+	if (!light_position.keys.empty())
+		scene.setLight(Light(light_position.at(frame), light_intensity.at(frame)));
+	if (spheres.empty())
+		return true;
+	for (const std::pair<const int, SphereTrack> &sphere : spheres)
+		scene.moveSphere(sphere.second.index, sphere.second.origin.at(frame), sphere.second.radius.at(frame));
+	return scene.commitEdits();
+}
+
+// Number of integer conversions of a printf format, -1 if it has another conversion
+static int integerConversions(const std::string &pattern) {
+	int n = 0;
+	for (size_t k = 0; k < pattern.size(); k++) {
+		if (pattern[k] != '%')
+			continue;
+		if (++k < pattern.size() && pattern[k] == '%')
+			continue;
+		while (k < pattern.size() && std::string("-+ #0").find(pattern[k]) != std::string::npos)
+			k++;
+		while (k < pattern.size() && isdigit(pattern[k]))
+			k++;
+		if (k == pattern.size() || (pattern[k] != 'd' && pattern[k] != 'i'))
+			return -1;
+		n++;
+	}
+	return n;
+}
+
+bool Animation::validFilePattern(const std::string &pattern) {
+	if (pattern.empty() || pattern.back() == '/')
+		return false;
+	return pattern.find('%') == std::string::npos || integerConversions(pattern) == 1;
+}
+
+std::string Animation::frameFileName(const std::string &pattern, int frame) {
+	char name[4096];
+	if (integerConversions(pattern) == 1)
+		snprintf(name, sizeof(name), pattern.c_str(), frame);
+	else {
+		size_t dot = pattern.find_last_of('.');
+		if (dot == std::string::npos || pattern.find('/', dot) != std::string::npos)
+			dot = pattern.size();
+		snprintf(name, sizeof(name), "%s%04d%s", pattern.substr(0, dot).c_str(), frame, pattern.substr(dot).c_str());
+	}
+	return name;
+}
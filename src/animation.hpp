@@ -0,0 +1,62 @@
+#ifndef ANIMATION_HPP
+#define ANIMATION_HPP
+
+#include "vector.hpp"
+#include "scene.hpp"
+#include <vector>
+#include <map>
+#include <string>
+#include <utility>
+
+/** Keyframed animation of the camera, the light and the spheres of a scene
+	Each animated quantity has its own keyframes, given at (possibly fractional) frame numbers. It is linearly
+	interpolated between them, and constant before the first one and after the last one. Spheres are identified
+	by their number in the scene file (0 for the first sphere outside groups), see Scene::sphereKey.
+*/
+class Animation {
+public:
+	// Load the keyframes from the file path. Returns false after printing an error if it cannot be loaded.
+	bool load(const std::string &path);
+	
+	// Find the animated spheres in the loaded scene. Returns false after printing an error if one of them is
+	// missing (e.g. converted to a plane).
+	bool bind(const Scene &scene);
+	
+	// Number of frames until the last keyframe
+	int frameCount() const;
+	
+	// Set the camera, the light and the spheres of the bound scene to their state at the given frame.
+	// Returns false if the scene is then invalid (intersecting transparent spheres).
+	bool apply(real frame, Scene &scene, Vector &camera) const;
+	
+	// Name of the file of a frame: pattern may contain a printf integer format (e.g. frame%04d.bmp), otherwise
+	// the frame number is added before the extension
+	static std::string frameFileName(const std::string &pattern, int frame);
+	// Whether pattern names files: not empty nor a directory, and either without % or with exactly one integer
+	// conversion (%d or %i with optional flags and width) and no other % than %%
+	static bool validFilePattern(const std::string &pattern);
+	
+private:
+	// Values of a quantity at its keyframes, sorted by frame
+	template <class T>
+	struct Track {
+		void add(real frame, const T &value);
+		T at(real frame) const;
+		
+		std::vector<std::pair<real, T> > keys;
+	};
+	
+	struct SphereTrack {
+		Track<Vector> origin;
+		Track<real> radius;
+		int index = -1; // Index of the sphere in the scene
+	};
+	
+	std::string file;
+	Track<Vector> camera;
+	Track<Vector> light_position;
+	Track<real> light_intensity;
+	std::map<int, SphereTrack> spheres; // By key of the sphere
+};
+
+#endif
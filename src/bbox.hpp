@@ -0,0 +1,62 @@
+#ifndef BBOX_HPP
+#define BBOX_HPP
+
+#include "vector.hpp"
+#include "utils.hpp"
+#include <limits>
+#include <algorithm>
+
+/** Axis-aligned bounding box */
+class BBox {
+public:
+	/* Constructors */
+	BBox() : min(std::numeric_limits<real>::max(), std::numeric_limits<real>::max(), std::numeric_limits<real>::max())
+		   , max(-std::numeric_limits<real>::max(), -std::numeric_limits<real>::max(), -std::numeric_limits<real>::max()) {} // Empty box
+	BBox(const Vector &a, const Vector &b) : min(a), max(b) {}
+	
+	void extend(const Vector &P) {
+		min = Vector(std::min(min.x, P.x), std::min(min.y, P.y), std::min(min.z, P.z));
+		max = Vector(std::max(max.x, P.x), std::max(max.y, P.y), std::max(max.z, P.z));
+	}
+	void extend(const BBox &b) {
+		extend(b.min);
+		extend(b.max);
+	}
+	
+	bool empty() const {return min.x > max.x;}
+	Vector center() const {return 0.5 * (min + max);}
+	real area() const { // Surface area, used by the SAH
+		if (empty())
+			return 0;
+		Vector d = max - min;
+		return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+	}
+	int largestAxis() const {
+		Vector d = max - min;
+		return (d.x > d.y && d.x > d.z) ? 0 : (d.y > d.z ? 1 : 2);
+	}
+	
+	// Slab test: returns true if the ray with given origin and inverse direction enters the box before t_max,
+	// and then sets t_enter to the entering distance. The exit distance is enlarged by the rounding error so that
+	// rays going exactly through a face or an edge are never missed.
+	bool intersect(const Vector &origin, const Vector &inv_dir, real t_max, real &t_enter) const {
+		real t0 = 0, t1 = t_max;
+		for (int a = 0; a < 3; a++) {
+			real near = (min[a] - origin[a]) * inv_dir[a];
+			real far = (max[a] - origin[a]) * inv_dir[a];
+			if (near > far)
+				std::swap(near, far);
+			far *= 1 + 2 * errorGamma(3);
+			t0 = near > t0 ? near : t0;
+			t1 = far < t1 ? far : t1;
+			if (t0 > t1)
+				return false;
+		}
+		t_enter = t0;
+		return true;
+	}
+	
+	Vector min, max;
+};
+
+#endif
@@ -0,0 +1,454 @@
+#include "bvh.hpp"
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include "scheduler.hpp"
+#include <math.h>
+
+// Number of bins used to evaluate the SAH along an axis
+constexpr int N_BINS = 16;
+// Maximum depth of the SAH splits. The depth of the tree itself is at most 16 more (leaves are limited
+// to 65535 primitives), so that traversal fits in a fixed size stack.
+constexpr int MAX_DEPTH = 64;
+
+void BVH::build(const std::vector<BBox> &boxes, unsigned max_leaf, const Settings &settings) {
+	nodes4.clear();
+	nodes8.clear();
+	qnodes4.clear();
+	qnodes8.clear();
+	if (settings.quality != HIGH)
+		buildLinear(boxes, max_leaf, settings.quality == BALANCED);
+	else {
+		nodes.clear();
+		indices.resize(boxes.size());
+		if (!boxes.empty()) {
+			std::vector<Vector> centers(boxes.size());
+			for (unsigned i = 0; i < boxes.size(); i++) {
+				indices[i] = i;
+				centers[i] = boxes[i].center();
+			}
+			nodes.reserve(2 * boxes.size());
+			buildNode(boxes, centers, 0, boxes.size(), max_leaf, 0, nodes);
+		}
+	}
+	box = nodes.empty() ? BBox() : nodes[0].box;
+	if (nodes.empty())
+		return;
+	if (settings.width == 4)
+		collapse(nodes4);
+	else if (settings.width == 8)
+		collapse(nodes8);
+	if (settings.compressed) {
+		quantize(nodes4, qnodes4);
+		quantize(nodes8, qnodes8);
+		std::vector<WideNode<4> >().swap(nodes4);
+		std::vector<WideNode<8> >().swap(nodes8);
+	}
+}
+
+size_t BVH::memory() const {
+	return nodes.size() * sizeof(Node) + nodes4.size() * sizeof(WideNode<4>) + nodes8.size() * sizeof(WideNode<8>)
+		+ qnodes4.size() * sizeof(QuantizedNode<4>) + qnodes8.size() * sizeof(QuantizedNode<8>) + indices.size() * sizeof(unsigned);
+}
+
+void BVH::save(CacheWriter &w) const {
+	w.write(nodes);
+	w.write(nodes4);
+	w.write(nodes8);
+	w.write(qnodes4);
+	w.write(qnodes8);
+	w.write(indices);
+	w.write(box);
+}
+
+bool BVH::load(CacheReader &r) {
+	return r.read(nodes) && r.read(nodes4) && r.read(nodes8) && r.read(qnodes4) && r.read(qnodes8) && r.read(indices)
+		&& r.read(box);
+}
+
+template <int N>
+void BVH::quantize(const std::vector<WideNode<N> > &wide, std::vector<QuantizedNode<N> > &quantized) {
+	quantized.resize(wide.size());
+	Scheduler::global().parallelFor(0, wide.size(), 4096, [&](unsigned first, unsigned last) {
+		for (unsigned i = first; i < last; i++)
+			quantizeNode(wide[i], quantized[i]);
+	});
+}
+
+template <int N>
+void BVH::quantizeNode(const WideNode<N> &node, QuantizedNode<N> &q) {
+	const real *b[6];
+	node.bounds(nullptr, b);
+	for (int a = 0; a < 3; a++) {
+		// The frame of the node is the union of the boxes of its children
+		real lo = std::numeric_limits<real>::max(), hi = -std::numeric_limits<real>::max();
+		for (int k = 0; k < N; k++)
+			if (b[a][k] <= b[a+3][k]) {
+				lo = std::min(lo, b[a][k]);
+				hi = std::max(hi, b[a+3][k]);
+			}
+		// The step is slightly enlarged (and not negligible before the origin) so that the
+		// largest quantized coordinate is beyond hi despite rounding
+		real scale = std::max((hi - lo) * (1 + 4 * errorGamma(1)) / 255, (std::abs(lo) + std::abs(hi)) * errorGamma(2));
+		q.origin[a] = lo;
+		q.scale[a] = scale;
+		for (int k = 0; k < N; k++) {
+			if (b[a][k] > b[a+3][k] || scale == 0) { // Unused child, or all the coordinates are 0
+				q.qmin[a][k] = (b[a][k] > b[a+3][k]) ? 255 : 0;
+				q.qmax[a][k] = 0;
+				continue;
+			}
+			// Round down the minimum and up the maximum, checking the decoded values
+			int qmin = std::min(std::max((int) floor((b[a][k] - lo) / scale), 0), 255);
+			while (qmin > 0 && lo + qmin * scale > b[a][k])
+				--qmin;
+			int qmax = std::min(std::max((int) ceil((b[a+3][k] - lo) / scale), 0), 255);
+			while (qmax < 255 && lo + qmax * scale < b[a+3][k])
+				++qmax;
+			q.qmin[a][k] = qmin;
+			q.qmax[a][k] = qmax;
+		}
+	}
+	for (int k = 0; k < N; k++) {
+		q.child[k] = node.child[k];
+		q.count[k] = node.count[k];
+	}
+}
+
+template <int N>
+void BVH::collapse(std::vector<WideNode<N> > &wide) {
+	wide.clear();
+	wide.reserve(nodes.size() / (N - 1) + 1);
+	collapseNode(0, wide);
+	std::vector<Node>().swap(nodes);
+}
+
+template <int N>
+unsigned BVH::collapseNode(unsigned index, std::vector<WideNode<N> > &wide) const {
+	// Children of the wide node: start from the binary node, then open the inner child of largest area
+	// until there are N children
+	unsigned children[N];
+	int n = 0;
+	if (nodes[index].count > 0)
+		children[n++] = index;
+	else {
+		children[n++] = index + 1;
+		children[n++] = nodes[index].offset;
+	}
+	while (n < N) {
+		int best = -1;
+		for (int k = 0; k < n; k++)
+			if (nodes[children[k]].count == 0 && (best < 0 || nodes[children[k]].box.area() > nodes[children[best]].box.area()))
+				best = k;
+		if (best < 0)
+			break;
+		unsigned opened = children[best];
+		children[best] = opened + 1;
+		children[n++] = nodes[opened].offset;
+	}
+	
+	unsigned current = wide.size();
+	wide.push_back(WideNode<N>());
+	for (int k = 0; k < N; k++) {
+		// Unused children have an empty box, which no ray intersects
+		BBox b = (k < n) ? nodes[children[k]].box : BBox();
+		WideNode<N> &node = wide[current];
+		node.min_x[k] = b.min.x;
+		node.min_y[k] = b.min.y;
+		node.min_z[k] = b.min.z;
+		node.max_x[k] = b.max.x;
+		node.max_y[k] = b.max.y;
+		node.max_z[k] = b.max.z;
+		node.child[k] = (k < n && nodes[children[k]].count > 0) ? nodes[children[k]].offset : 0;
+		node.count[k] = (k < n) ? nodes[children[k]].count : 0;
+	}
+	for (int k = 0; k < n; k++)
+		if (nodes[children[k]].count == 0) {
+			unsigned child = collapseNode(children[k], wide);
+			wide[current].child[k] = child;
+		}
+	return current;
+}
+
+void BVH::buildNode(const std::vector<BBox> &boxes, const std::vector<Vector> &centers, unsigned begin, unsigned end
+					, unsigned max_leaf, int depth, std::vector<Node> &out) {
+	unsigned current = out.size();
+	out.push_back(Node());
+	BBox box, center_box;
+	for (unsigned i = begin; i < end; i++) {
+		box.extend(boxes[indices[i]]);
+		center_box.extend(centers[indices[i]]);
+	}
+	out[current].box = box;
+	
+	unsigned n = end - begin;
+	int axis = center_box.largestAxis();
+	real cmin = center_box.min[axis], cmax = center_box.max[axis];
+	bool can_split = (cmax > cmin && depth < MAX_DEPTH); // Primitives can be separated by their centers
+	bool can_be_leaf = (n <= std::numeric_limits<unsigned short>::max());
+	if (can_be_leaf && (n == 1 || !can_split)) {
+		out[current].offset = begin;
+		out[current].count = n;
+		return;
+	}
+	
+	unsigned mid = begin;
+	if (can_split) {
+		// Bin the centers along the largest axis and choose the split minimizing the SAH cost
+		BBox bin_boxes[N_BINS];
+		unsigned bin_counts[N_BINS] = {0};
+		real scale = N_BINS / (cmax - cmin);
+		auto binOf = [&](unsigned i) {
+			int b = (int) ((centers[i][axis] - cmin) * scale);
+			return std::min(std::max(b, 0), N_BINS - 1);
+		};
+		for (unsigned i = begin; i < end; i++) {
+			int b = binOf(indices[i]);
+			bin_counts[b]++;
+			bin_boxes[b].extend(boxes[indices[i]]);
+		}
+		// Areas and counts of the left sides, then sweep from the right
+		real left_area[N_BINS];
+		unsigned left_count[N_BINS];
+		BBox acc;
+		unsigned count = 0;
+		for (int b = 0; b < N_BINS - 1; b++) {
+			acc.extend(bin_boxes[b]);
+			count += bin_counts[b];
+			left_area[b] = acc.area();
+			left_count[b] = count;
+		}
+		acc = BBox();
+		count = 0;
+		real best_cost = std::numeric_limits<real>::max();
+		int best = -1;
+		for (int b = N_BINS - 1; b > 0; b--) {
+			acc.extend(bin_boxes[b]);
+			count += bin_counts[b];
+			real cost = left_area[b-1] * left_count[b-1] + acc.area() * count;
+			if (left_count[b-1] > 0 && count > 0 && cost < best_cost) {
+				best_cost = cost;
+				best = b;
+			}
+		}
+		// Make a leaf if it is small enough and cheaper than the split (with a traversal cost of 1
+		// and an intersection cost of 1 per primitive)
+		if (n <= max_leaf && (best < 0 || 1 + best_cost / box.area() >= n)) {
+			out[current].offset = begin;
+			out[current].count = n;
+			return;
+		}
+		if (best > 0)
+			mid = std::partition(&indices[begin], &indices[begin] + n, [&](unsigned i) {return binOf(i) < best;}) - &indices[0];
+	}
+	// If no split was found (or the primitives cannot be separated but are too many for one leaf), split in the middle
+	if (mid == begin || mid == end) {
+		mid = begin + n / 2;
+		if (cmax > cmin)
+			std::nth_element(&indices[begin], &indices[mid], &indices[begin] + n, [&](unsigned i, unsigned j) {
+				return centers[i][axis] < centers[j][axis];
+			});
+	}
+	
+	out[current].count = 0;
+	out[current].axis = axis;
+	buildNode(boxes, centers, begin, mid, max_leaf, depth + 1, out);
+	out[current].offset = out.size();
+	buildNode(boxes, centers, mid, end, max_leaf, depth + 1, out);
+}
+
+/*** Linear BVH ***/
+
+// Number of bits of the Morton codes along each axis
+constexpr int MORTON_BITS = 10;
+
+// Spread the 10 lower bits of v, with two zero bits between consecutive bits
+static unsigned spreadBits(unsigned v) {
+	v = (v | (v << 16)) & 0x030000FF;
+	v = (v | (v << 8)) & 0x0300F00F;
+	v = (v | (v << 4)) & 0x030C30C3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+// Sort the keys and their values by a least significant digit radix sort, 8 bits per pass. The keys are cut
+// in one chunk per thread: the digits of each chunk are counted in parallel, then each chunk is scattered at the
+// positions given by the counts of all the chunks, which keeps each pass stable.
+static void radixSort(std::vector<unsigned> &keys, std::vector<unsigned> &values) {
+	unsigned n = keys.size();
+	Scheduler &scheduler = Scheduler::global();
+	unsigned n_chunks = scheduler.threadCount();
+	std::vector<unsigned> keys_tmp(n), values_tmp(n);
+	std::vector<unsigned> counts(256 * n_chunks);
+	auto chunkBegin = [&](unsigned chunk) {return (unsigned) ((unsigned long) n * chunk / n_chunks);};
+	for (int shift = 0; shift < 3 * MORTON_BITS; shift += 8) {
+		scheduler.parallelFor(0, n_chunks, 1, [&](unsigned chunk, unsigned) {
+			unsigned *count = &counts[256 * chunk];
+			std::fill(count, count + 256, 0);
+			for (unsigned i = chunkBegin(chunk); i < chunkBegin(chunk + 1); i++)
+				++count[(keys[i] >> shift) & 255];
+		});
+		// Positions of the digits of each chunk: digit by digit, then chunk by chunk
+		unsigned sum = 0;
+		for (int d = 0; d < 256; d++)
+			for (unsigned t = 0; t < n_chunks; t++) {
+				unsigned c = counts[256 * t + d];
+				counts[256 * t + d] = sum;
+				sum += c;
+			}
+		scheduler.parallelFor(0, n_chunks, 1, [&](unsigned chunk, unsigned) {
+			unsigned *count = &counts[256 * chunk];
+			for (unsigned i = chunkBegin(chunk); i < chunkBegin(chunk + 1); i++) {
+				unsigned pos = count[(keys[i] >> shift) & 255]++;
+				keys_tmp[pos] = keys[i];
+				values_tmp[pos] = values[i];
+			}
+		});
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
+
+// Split of the sorted codes[begin..end) at their highest differing bit. Returns false if they are all equal,
+// otherwise sets mid to the first code with this bit set and axis to the axis of the bit.
+static bool mortonSplit(const std::vector<unsigned> &codes, unsigned begin, unsigned end, unsigned &mid, int &axis) {
+	unsigned diff = codes[begin] ^ codes[end - 1];
+	if (diff == 0)
+		return false;
+	int bit = 31 - __builtin_clz(diff);
+	mid = std::partition_point(codes.begin() + begin, codes.begin() + end, [&](unsigned c) {
+		return !((c >> bit) & 1);
+	}) - codes.begin();
+	axis = 2 - bit % 3; // Bits are interleaved as x, y, z from the most significant one
+	return true;
+}
+
+void BVH::buildLinear(const std::vector<BBox> &boxes, unsigned max_leaf, bool sah) {
+	nodes.clear();
+	unsigned n = boxes.size();
+	indices.resize(n);
+	if (n == 0)
+		return;
+	
+	// Morton codes of the centers of the boxes, relatively to the bounds of the centers
+	Scheduler &scheduler = Scheduler::global();
+	std::vector<Vector> centers(n);
+	BBox center_box;
+	std::mutex center_mutex;
+	scheduler.parallelFor(0, n, 16384, [&](unsigned first, unsigned last) {
+		BBox local;
+		for (unsigned i = first; i < last; i++) {
+			centers[i] = boxes[i].center();
+			local.extend(centers[i]);
+		}
+		std::lock_guard<std::mutex> lock(center_mutex);
+		center_box.extend(local);
+	});
+	Vector extent = center_box.max - center_box.min;
+	real grid_max = (1 << MORTON_BITS) - 1;
+	Vector scale(extent.x > 0 ? grid_max / extent.x : 0, extent.y > 0 ? grid_max / extent.y : 0, extent.z > 0 ? grid_max / extent.z : 0);
+	std::vector<unsigned> codes(n);
+	scheduler.parallelFor(0, n, 16384, [&](unsigned first, unsigned last) {
+		for (unsigned i = first; i < last; i++) {
+			Vector c = centers[i] - center_box.min;
+			codes[i] = (spreadBits((unsigned) (c.x * scale.x)) << 2) | (spreadBits((unsigned) (c.y * scale.y)) << 1)
+					 | spreadBits((unsigned) (c.z * scale.z));
+			indices[i] = i;
+		}
+	});
+	radixSort(codes, indices);
+	
+	// Top of the tree: split the primitives at their Morton codes until the subtrees are small enough to balance
+	// the work between the threads
+	struct TopNode {
+		unsigned begin, end;
+		int left, right; // Children in top, -1 for a subtree
+		int axis;
+		int subtree; // Index of the subtree, -1 for an inner node
+	};
+	unsigned grain = std::max(n / (16 * scheduler.threadCount()), (unsigned) 1024);
+	std::vector<TopNode> top = {{0, n, -1, -1, 0, -1}};
+	std::vector<unsigned> subtrees; // Indices in top
+	for (unsigned i = 0; i < top.size(); i++) {
+		unsigned begin = top[i].begin, end = top[i].end, mid;
+		int axis;
+		if (end - begin <= grain || !mortonSplit(codes, begin, end, mid, axis)) {
+			top[i].subtree = subtrees.size();
+			subtrees.push_back(i);
+			continue;
+		}
+		top[i].axis = axis;
+		top[i].left = top.size();
+		top.push_back({begin, mid, -1, -1, 0, -1});
+		top[i].right = top.size();
+		top.push_back({mid, end, -1, -1, 0, -1});
+	}
+	
+	// Build the subtrees in parallel
+	std::vector<std::vector<Node> > subtree_nodes(subtrees.size());
+	scheduler.parallelFor(0, subtrees.size(), 1, [&](unsigned k, unsigned) {
+		const TopNode &t = top[subtrees[k]];
+		subtree_nodes[k].reserve(2 * (t.end - t.begin));
+		if (sah)
+			buildNode(boxes, centers, t.begin, t.end, max_leaf, 0, subtree_nodes[k]);
+		else
+			emitNode(boxes, codes, t.begin, t.end, max_leaf, subtree_nodes[k]);
+	});
+	
+	// Gather everything in depth-first order, the offsets of the inner nodes of the subtrees being shifted
+	nodes.reserve(2 * n);
+	std::function<void(unsigned)> place = [&](unsigned i) {
+		const TopNode &t = top[i];
+		if (t.subtree >= 0) {
+			unsigned base = nodes.size();
+			for (Node node : subtree_nodes[t.subtree]) {
+				if (node.count == 0)
+					node.offset += base;
+				nodes.push_back(node);
+			}
+			std::vector<Node>().swap(subtree_nodes[t.subtree]);
+			return;
+		}
+		unsigned current = nodes.size();
+		nodes.push_back(Node());
+		place(t.left);
+		nodes[current].offset = nodes.size();
+		place(t.right);
+		nodes[current].box = nodes[current + 1].box;
+		nodes[current].box.extend(nodes[nodes[current].offset].box);
+		nodes[current].count = 0;
+		nodes[current].axis = t.axis;
+	};
+	place(0);
+}
+
+void BVH::emitNode(const std::vector<BBox> &boxes, const std::vector<unsigned> &codes, unsigned begin, unsigned end
+				   , unsigned max_leaf, std::vector<Node> &out) {
+	unsigned current = out.size();
+	out.push_back(Node());
+	unsigned n = end - begin;
+	if (n <= max_leaf) {
+		BBox box;
+		for (unsigned i = begin; i < end; i++)
+			box.extend(boxes[indices[i]]);
+		out[current].box = box;
+		out[current].offset = begin;
+		out[current].count = n;
+		return;
+	}
+	
+	unsigned mid;
+	int axis;
+	if (!mortonSplit(codes, begin, end, mid, axis)) {
+		// Same code for all the primitives: split in the middle
+		mid = begin + n / 2;
+		axis = 0;
+	}
+	emitNode(boxes, codes, begin, mid, max_leaf, out);
+	out[current].offset = out.size();
+	emitNode(boxes, codes, mid, end, max_leaf, out);
+	out[current].box = out[current + 1].box;
+	out[current].box.extend(out[out[current].offset].box);
+	out[current].count = 0;
+	out[current].axis = axis;
+}
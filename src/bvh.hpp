@@ -0,0 +1,380 @@
+#ifndef BVH_HPP
+#define BVH_HPP
+
+#include "vector.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "cache.hpp"
+#include <vector>
+#include <limits>
+#include <cmath>
+
+/** Bounding volume hierarchy over a set of primitives known by their bounding boxes
+	The tree is built with the surface area heuristic (SAH) and stored as an array of nodes in depth-first
+	order: the first child of an inner node is the next node. The primitives themselves are not stored, only
+	their indices in leaf order, so the same structure is used for triangles, spheres or instances.
+	The binary tree can then be collapsed into a wide tree of 4 or 8 children per node, whose boxes are stored
+	in SoA form and tested together with SIMD instructions.
+*/
+class BVH {
+public:
+	struct Node {
+		BBox box;
+		unsigned offset; // For a leaf, position of its first primitive in indices; otherwise index of the second child
+		unsigned short count; // Number of primitives of a leaf, 0 for an inner node
+		unsigned char axis; // Split axis of an inner node, used to visit the closest child first
+	};
+	
+	/* Trade-off between build time and traversal time:
+	   - FAST: linear BVH, the primitives are sorted along a Morton curve (parallel radix sort) and split
+	     according to the bits of their codes, subtrees being emitted in parallel
+	   - BALANCED: the top levels are split as in FAST, then each subtree is built with the SAH in parallel
+	   - HIGH: the whole tree is built top-down with the SAH, on one thread */
+	enum Quality : unsigned char {FAST, BALANCED, HIGH};
+	
+	struct Settings {
+		Settings(Quality q = HIGH, int w = 2, bool c = false) : quality(q), width(w), compressed(c) {}
+		
+		Quality quality;
+		int width; // Number of children of the nodes: 2, 4 or 8
+		bool compressed; // Quantize the boxes of the children of wide nodes
+	};
+	
+	// Node of a wide tree with N children. Unused children have an empty box.
+	template <int N>
+	struct WideNode {
+		// Pointers to the arrays of the coordinates of the boxes of the children: min x, y, z then max x, y, z
+		void bounds(real (*)[N], const real *b[6]) const {
+			b[0] = min_x; b[1] = min_y; b[2] = min_z;
+			b[3] = max_x; b[4] = max_y; b[5] = max_z;
+		}
+		
+		real min_x[N], min_y[N], min_z[N], max_x[N], max_y[N], max_z[N]; // Boxes of the children
+		unsigned child[N]; // Index of the child node, or position of the first primitive of a leaf child
+		unsigned short count[N]; // Number of primitives of a leaf child, 0 for a child node
+	};
+	
+	// Same with the boxes of the children quantized to 8 bits in the box of the node, about half the size.
+	// The quantized boxes contain the exact ones. Unused children have qmin > qmax.
+	template <int N>
+	struct QuantizedNode {
+		// Same as for WideNode, the boxes being decoded into buffer
+		void bounds(real (*buffer)[N], const real *b[6]) const {
+			for (int a = 0; a < 3; a++) {
+				#pragma omp simd
+				for (int k = 0; k < N; k++) {
+					bool unused = qmin[a][k] > qmax[a][k];
+					buffer[a][k] = unused ? std::numeric_limits<real>::max() : origin[a] + qmin[a][k] * scale[a];
+					buffer[a+3][k] = unused ? -std::numeric_limits<real>::max() : origin[a] + qmax[a][k] * scale[a];
+				}
+				b[a] = buffer[a];
+				b[a+3] = buffer[a+3];
+			}
+		}
+		
+		real origin[3], scale[3]; // A quantized coordinate q means origin + q * scale
+		unsigned char qmin[3][N], qmax[3][N];
+		unsigned child[N];
+		unsigned short count[N];
+	};
+	
+	// Build the hierarchy over the primitives with the given bounding boxes, with at most max_leaf
+	// primitives per leaf (unless they cannot be separated)
+	void build(const std::vector<BBox> &boxes, unsigned max_leaf = 4, const Settings &settings = Settings());
+	
+	bool empty() const {return box.empty();}
+	const BBox &bounds() const {return box;}
+	int width() const {return (!nodes4.empty() || !qnodes4.empty()) ? 4 : ((!nodes8.empty() || !qnodes8.empty()) ? 8 : 2);}
+	bool compressed() const {return !qnodes4.empty() || !qnodes8.empty();}
+	size_t nodeCount() const {return nodes.size() + nodes4.size() + nodes8.size() + qnodes4.size() + qnodes8.size();}
+	size_t memory() const; // Size of the nodes and indices in bytes
+	
+	// Write the hierarchy to a cache file, and read it back (returns false if the cache is invalid)
+	void save(CacheWriter &w) const;
+	bool load(CacheReader &r);
+	
+	// Visit the leaves whose box is intersected by the ray before t_max, closest children first.
+	// For each of them, leaf(first, count, t_max) is called with the range of the leaf in indices and must
+	// return the new t_max (the distance of the closest hit found so far, or the input t_max).
+	template <class Leaf>
+	void traverse(const Ray &ray, real t_max, Leaf leaf) const;
+	
+	// Largest packet of rays traversed together
+	static constexpr int MAX_PACKET = 16;
+	
+	// Same for a packet of n <= MAX_PACKET coherent rays with their own t_max, updated by the leaves:
+	// leaf(first, count, mask) is called with the mask of the rays of the packet which enter the leaf box before
+	// their t_max, and must update their t_max. The children of a node are first culled for all the rays at once,
+	// by bounding the distances to their boxes over the packet with interval arithmetic, then tested ray by ray.
+	// Each ray visits at least the leaves that traverse would visit. Returns false without visiting anything if the
+	// packet cannot be traversed together (binary tree, or rays whose directions are not in the same octant), in
+	// which case the rays should be traversed one by one.
+	template <class Leaf>
+	bool traversePacket(const Ray *rays, int n, real *t_max, Leaf leaf) const;
+	
+	std::vector<Node> nodes; // Binary tree, empty once collapsed
+	std::vector<WideNode<4> > nodes4; // Wide tree, if the width is 4
+	std::vector<WideNode<8> > nodes8; // Same for a width of 8
+	std::vector<QuantizedNode<4> > qnodes4; // Compressed wide trees
+	std::vector<QuantizedNode<8> > qnodes8;
+	std::vector<unsigned> indices; // Indices of the primitives in leaf order
+	
+private:
+	// Replace the binary tree by a wide one, whose nodes are made of the binary node and its descendants
+	// of largest area
+	template <int N>
+	void collapse(std::vector<WideNode<N> > &wide);
+	template <int N>
+	unsigned collapseNode(unsigned index, std::vector<WideNode<N> > &wide) const;
+	
+	// Compressed copy of a wide tree
+	template <int N>
+	static void quantize(const std::vector<WideNode<N> > &wide, std::vector<QuantizedNode<N> > &quantized);
+	template <int N>
+	static void quantizeNode(const WideNode<N> &node, QuantizedNode<N> &q);
+	
+	template <int N, class WideNodeT, class Leaf>
+	void traverseWide(const std::vector<WideNodeT> &wide, const Ray &ray, real t_max, Leaf leaf) const;
+	template <int N, class WideNodeT, class Leaf>
+	bool traversePacketWide(const std::vector<WideNodeT> &wide, const Ray *rays, int n, real *t_max, Leaf leaf) const;
+	
+	// Build of FAST and BALANCED quality
+	void buildLinear(const std::vector<BBox> &boxes, unsigned max_leaf, bool sah);
+	
+	// Recursively build with the SAH the subtree of the primitives indices[begin..end), appending its nodes to out
+	void buildNode(const std::vector<BBox> &boxes, const std::vector<Vector> &centers, unsigned begin, unsigned end
+				   , unsigned max_leaf, int depth, std::vector<Node> &out);
+	
+	// Recursively build the subtree of indices[begin..end) by splitting at the Morton codes codes[begin..end)
+	// of the primitives, appending its nodes to out
+	void emitNode(const std::vector<BBox> &boxes, const std::vector<unsigned> &codes, unsigned begin, unsigned end
+				  , unsigned max_leaf, std::vector<Node> &out);
+	
+	BBox box; // Bounds of all the primitives
+};
+
+template <class Leaf>
+void BVH::traverse(const Ray &ray, real t_max, Leaf leaf) const {
+	if (!nodes4.empty())
+		return traverseWide<4>(nodes4, ray, t_max, leaf);
+	if (!nodes8.empty())
+		return traverseWide<8>(nodes8, ray, t_max, leaf);
+	if (!qnodes4.empty())
+		return traverseWide<4>(qnodes4, ray, t_max, leaf);
+	if (!qnodes8.empty())
+		return traverseWide<8>(qnodes8, ray, t_max, leaf);
+	if (nodes.empty())
+		return;
+	Vector inv_dir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	bool negative[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+	unsigned stack[128];
+	int top = 0;
+	unsigned current = 0;
+	while (true) {
+		const Node &node = nodes[current];
+		real t_enter;
+		if (node.box.intersect(ray.origin, inv_dir, t_max, t_enter)) {
+			if (node.count > 0)
+				t_max = leaf(node.offset, node.count, t_max);
+			else {
+				// Visit first the child which is on the side the ray comes from
+				if (negative[node.axis]) {
+					stack[top++] = current + 1;
+					current = node.offset;
+				}
+				else {
+					stack[top++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+		if (top == 0)
+			break;
+		current = stack[--top];
+	}
+}
+
+template <int N, class WideNodeT, class Leaf>
+void BVH::traverseWide(const std::vector<WideNodeT> &wide, const Ray &ray, real t_max, Leaf leaf) const {
+	Vector inv_dir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	bool negative[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+	const real far_scale = 1 + 2 * errorGamma(3); // As in BBox::intersect
+	// Nodes to visit with the distance at which the ray enters them
+	struct Entry {
+		unsigned node;
+		real t;
+	} stack[96 * N];
+	int top = 0;
+	stack[top++] = {0, 0};
+	while (top > 0) {
+		Entry entry = stack[--top];
+		if (entry.t > t_max)
+			continue;
+		const WideNodeT &node = wide[entry.node];
+		real buffer[6][N];
+		const real *b[6];
+		node.bounds(buffer, b);
+		// Slab tests of all the children at once, the near and far planes being chosen by the direction signs
+		const real *near_x = b[negative[0] ? 3 : 0], *far_x = b[negative[0] ? 0 : 3];
+		const real *near_y = b[negative[1] ? 4 : 1], *far_y = b[negative[1] ? 1 : 4];
+		const real *near_z = b[negative[2] ? 5 : 2], *far_z = b[negative[2] ? 2 : 5];
+		real t_near[N], t_far[N];
+		#pragma omp simd
+		for (int k = 0; k < N; k++) {
+			real t0 = 0, t1 = t_max;
+			real near = (near_x[k] - ray.origin.x) * inv_dir.x, far = (far_x[k] - ray.origin.x) * inv_dir.x * far_scale;
+			t0 = near > t0 ? near : t0;
+			t1 = far < t1 ? far : t1;
+			near = (near_y[k] - ray.origin.y) * inv_dir.y;
+			far = (far_y[k] - ray.origin.y) * inv_dir.y * far_scale;
+			t0 = near > t0 ? near : t0;
+			t1 = far < t1 ? far : t1;
+			near = (near_z[k] - ray.origin.z) * inv_dir.z;
+			far = (far_z[k] - ray.origin.z) * inv_dir.z * far_scale;
+			t0 = near > t0 ? near : t0;
+			t1 = far < t1 ? far : t1;
+			t_near[k] = t0;
+			t_far[k] = t1;
+		}
+		// Sort the children which are hit front to back
+		int hit[N], n_hit = 0;
+		for (int k = 0; k < N; k++) {
+			if (t_near[k] > t_far[k])
+				continue;
+			int j = n_hit++;
+			for (; j > 0 && t_near[hit[j-1]] > t_near[k]; j--)
+				hit[j] = hit[j-1];
+			hit[j] = k;
+		}
+		// Visit the leaves now, closest first, then push the child nodes so that the closest is popped first
+		for (int j = 0; j < n_hit; j++)
+			if (node.count[hit[j]] > 0 && t_near[hit[j]] <= t_max)
+				t_max = leaf(node.child[hit[j]], node.count[hit[j]], t_max);
+		for (int j = n_hit - 1; j >= 0; j--)
+			if (node.count[hit[j]] == 0 && t_near[hit[j]] <= t_max)
+				stack[top++] = {node.child[hit[j]], t_near[hit[j]]};
+	}
+}
+
+template <class Leaf>
+bool BVH::traversePacket(const Ray *rays, int n, real *t_max, Leaf leaf) const {
+	if (!nodes4.empty())
+		return traversePacketWide<4>(nodes4, rays, n, t_max, leaf);
+	if (!nodes8.empty())
+		return traversePacketWide<8>(nodes8, rays, n, t_max, leaf);
+	if (!qnodes4.empty())
+		return traversePacketWide<4>(qnodes4, rays, n, t_max, leaf);
+	if (!qnodes8.empty())
+		return traversePacketWide<8>(qnodes8, rays, n, t_max, leaf);
+	return nodes.empty();
+}
+
+template <int N, class WideNodeT, class Leaf>
+bool BVH::traversePacketWide(const std::vector<WideNodeT> &wide, const Ray *rays, int n, real *t_max, Leaf leaf) const {
+	// Rays as structure of arrays
+	real o[3][MAX_PACKET], inv[3][MAX_PACKET];
+	bool negative[3];
+	for (int a = 0; a < 3; a++) {
+		for (int k = 0; k < n; k++) {
+			o[a][k] = rays[k].origin[a];
+			inv[a][k] = 1 / rays[k].direction[a];
+			// The near and far planes of the boxes must be the same for all the rays, and the intervals finite
+			if (!std::isfinite(inv[a][k]) || (inv[a][k] < 0) != (inv[a][0] < 0))
+				return false;
+		}
+		negative[a] = inv[a][0] < 0;
+	}
+	/* Interval arithmetic: the distance (plane - origin) * inverse direction at which a ray crosses a plane is
+	   bounded over the packet by the products of the bounds of the two intervals. With the signs of the inverse
+	   directions fixed, the origins giving the lower bound at the near planes and the upper bound at the far planes
+	   are known, and the bound of the inverse direction only depends on the sign of (plane - origin). Rounding being
+	   monotonic, the bounds also hold for the values computed for each ray. */
+	real o_near[3], o_far[3], inv_lo[3], inv_hi[3];
+	for (int a = 0; a < 3; a++) {
+		real o_lo = *std::min_element(o[a], o[a] + n), o_hi = *std::max_element(o[a], o[a] + n);
+		o_near[a] = negative[a] ? o_lo : o_hi;
+		o_far[a] = negative[a] ? o_hi : o_lo;
+		inv_lo[a] = *std::min_element(inv[a], inv[a] + n);
+		inv_hi[a] = *std::max_element(inv[a], inv[a] + n);
+	}
+	const real far_scale = 1 + 2 * errorGamma(3); // As in BBox::intersect
+	
+	// Nodes to visit with the mask of the rays which enter them
+	struct Entry {
+		unsigned node;
+		unsigned mask;
+	} stack[96 * N];
+	int top = 0;
+	stack[top++] = {0, (1u << n) - 1};
+	while (top > 0) {
+		Entry entry = stack[--top];
+		real packet_t_max = 0;
+		for (int k = 0; k < n; k++)
+			packet_t_max = (entry.mask >> k & 1) && t_max[k] > packet_t_max ? t_max[k] : packet_t_max;
+		const WideNodeT &node = wide[entry.node];
+		real buffer[6][N];
+		const real *b[6];
+		node.bounds(buffer, b);
+		const real *near[3] = {b[negative[0] ? 3 : 0], b[negative[1] ? 4 : 1], b[negative[2] ? 5 : 2]};
+		const real *far[3] = {b[negative[0] ? 0 : 3], b[negative[1] ? 1 : 4], b[negative[2] ? 2 : 5]};
+		// Slab tests of all the children for the whole packet
+		real t_near[N], t_far[N];
+		#pragma omp simd
+		for (int c = 0; c < N; c++) {
+			real t0 = 0, t1 = packet_t_max;
+			for (int a = 0; a < 3; a++) {
+				real d_near = near[a][c] - o_near[a], d_far = far[a][c] - o_far[a];
+				real lower = d_near * (d_near >= 0 ? inv_lo[a] : inv_hi[a]);
+				real upper = d_far * (d_far >= 0 ? inv_hi[a] : inv_lo[a]) * far_scale;
+				t0 = lower > t0 ? lower : t0;
+				t1 = upper < t1 ? upper : t1;
+			}
+			t_near[c] = t0;
+			t_far[c] = t1;
+		}
+		unsigned masks[N];
+		int hit[N], n_hit = 0;
+		for (int c = 0; c < N; c++) {
+			if (t_near[c] > t_far[c])
+				continue;
+			// Range of the rays which enter the child, from the first and the last of them with the slab test of
+			// traverseWide. The rays in between are kept without being tested.
+			auto rayHit = [&](int k) {
+				real t0 = 0, t1 = t_max[k];
+				for (int a = 0; a < 3; a++) {
+					real near_t = (near[a][c] - o[a][k]) * inv[a][k], far_t = (far[a][c] - o[a][k]) * inv[a][k] * far_scale;
+					t0 = near_t > t0 ? near_t : t0;
+					t1 = far_t < t1 ? far_t : t1;
+				}
+				return t0 <= t1;
+			};
+			unsigned rest = entry.mask;
+			while (rest != 0 && !rayHit(__builtin_ctz(rest)))
+				rest &= rest - 1;
+			if (rest == 0)
+				continue;
+			int first = __builtin_ctz(rest), last = 31 - __builtin_clz(rest);
+			while (last > first && !rayHit(last)) {
+				rest &= ~(1u << last);
+				last = 31 - __builtin_clz(rest);
+			}
+			masks[c] = rest;
+			// Sorted front to back by the lower bound of the packet
+			int j = n_hit++;
+			for (; j > 0 && t_near[hit[j-1]] > t_near[c]; j--)
+				hit[j] = hit[j-1];
+			hit[j] = c;
+		}
+		// Leaves first, closest first, then the child nodes so that the closest is popped first
+		for (int j = 0; j < n_hit; j++)
+			if (node.count[hit[j]] > 0)
+				leaf(node.child[hit[j]], node.count[hit[j]], masks[hit[j]]);
+		for (int j = n_hit - 1; j >= 0; j--)
+			if (node.count[hit[j]] == 0)
+				stack[top++] = {node.child[hit[j]], masks[hit[j]]};
+	}
+	return true;
+}
+
+#endif
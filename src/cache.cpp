@@ -0,0 +1,78 @@
+#include "cache.hpp"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <sstream>
+#include <iomanip>
+
+// Alignment of the records of cache files
+constexpr size_t CACHE_ALIGN = 8;
+
+bool Hash::addFile(const std::string &path) {
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+	char buffer[1 << 16];
+	while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+		add(buffer, file.gcount());
+	return true;
+}
+
+std::string Hash::hex() const {
+	std::stringstream s;
+	s << std::hex << std::setw(16) << std::setfill('0') << value;
+	return s.str();
+}
+
+CacheWriter::CacheWriter(const std::string &p)
+	: path(p), tmp(p + ".XXXXXX"), file(nullptr), size(0), failed(false), committed(false) {
+	int fd = mkstemp(&tmp[0]);
+	if (fd < 0)
+		return;
+	fchmod(fd, 0644); // mkstemp creates the file readable by its owner only
+	file = fdopen(fd, "wb");
+	if (!file)
+		close(fd);
+}
+
+CacheWriter::~CacheWriter() {
+	if (file)
+		fclose(file);
+	if (!committed)
+		remove(tmp.c_str());
+}
+
+void CacheWriter::raw(const void *data, size_t n) {
+	if (!file)
+		return;
+	static const char zeros[CACHE_ALIGN] = {0};
+	size_t padding = (CACHE_ALIGN - (size + n) % CACHE_ALIGN) % CACHE_ALIGN;
+	if (fwrite(data, 1, n, file) != n || fwrite(zeros, 1, padding, file) != padding)
+		failed = true;
+	size += n + padding;
+}
+
+bool CacheWriter::commit() {
+	if (!file)
+		return false;
+	failed = fclose(file) != 0 || failed;
+	file = nullptr;
+	committed = !failed && rename(tmp.c_str(), path.c_str()) == 0;
+	return committed;
+}
+
+CacheReader::CacheReader(const std::string &path) : file(path, std::ios::binary), size(0), pos(0) {
+	if (file.seekg(0, std::ios::end)) {
+		size = file.tellg();
+		file.seekg(0);
+	}
+}
+
+bool CacheReader::raw(void *data, size_t n) {
+	size_t padded = (n + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+	if (padded > size - pos || !file.read((char*) data, n) || !file.ignore(padded - n))
+		return false;
+	pos += padded;
+	return true;
+}
@@ -0,0 +1,114 @@
+#ifndef CACHE_HPP
+#define CACHE_HPP
+
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cstring>
+#include <cstdio>
+#include <type_traits>
+
+/** 64-bit FNV-1a hash, used to key the cache by the content of the inputs */
+class Hash {
+public:
+	Hash() : value(14695981039346656037ULL) {}
+	
+	void add(const void *data, size_t size) {
+		const unsigned char *bytes = (const unsigned char*) data;
+		for (size_t i = 0; i < size; i++)
+			value = (value ^ bytes[i]) * 1099511628211ULL;
+	}
+	void add(const std::string &s) {add(s.data(), s.size());}
+	// Add the content of a file, returns false if it cannot be read
+	bool addFile(const std::string &path);
+	
+	std::string hex() const; // Value as 16 hexadecimal digits
+	
+	unsigned long long value;
+};
+
+/** Binary file of cached data
+	The file is written under a unique temporary name in the same directory, and renamed by commit() once complete,
+	so that concurrent runs never read a partial file nor publish each other's. Records are aligned on 8 bytes.
+	Only trivially copyable types are written as raw bytes.
+*/
+class CacheWriter {
+public:
+	CacheWriter(const std::string &path);
+	~CacheWriter(); // Removes the temporary file if it was not committed
+	CacheWriter(const CacheWriter&) = delete;
+	CacheWriter &operator=(const CacheWriter&) = delete;
+	
+	bool good() const {return file && !failed;}
+	
+	template <class T>
+	void write(const T &x) {
+		static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types are cached as bytes");
+		raw(&x, sizeof(T));
+	}
+	template <class T>
+	void write(const std::vector<T> &v) {
+		static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types are cached as bytes");
+		write((unsigned long long) v.size());
+		raw(v.data(), v.size() * sizeof(T));
+	}
+	void write(const std::string &s) {
+		write((unsigned long long) s.size());
+		raw(s.data(), s.size());
+	}
+	
+	// Close the file and rename it to its path, returns false if a write failed
+	bool commit();
+
+private:
+	void raw(const void *data, size_t n);
+	
+	std::string path, tmp;
+	std::FILE *file;
+	size_t size;
+	bool failed, committed;
+};
+
+/** Reading of a file written by CacheWriter
+	The records are read from the file straight into their destination (a buffered read, without an intermediate
+	copy). All the read functions return false if the file is too short (truncated or corrupted cache).
+*/
+class CacheReader {
+public:
+	CacheReader(const std::string &path);
+	CacheReader(const CacheReader&) = delete;
+	CacheReader &operator=(const CacheReader&) = delete;
+	
+	bool good() const {return file.is_open() && size > 0;}
+	
+	template <class T>
+	bool read(T &x) {
+		static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types are cached as bytes");
+		return raw(&x, sizeof(T));
+	}
+	template <class T>
+	bool read(std::vector<T> &v) {
+		static_assert(std::is_trivially_copyable<T>::value, "only trivially copyable types are cached as bytes");
+		unsigned long long n;
+		if (!read(n) || n > (size - pos) / sizeof(T))
+			return false;
+		v.resize(n);
+		return raw(v.data(), n * sizeof(T));
+	}
+	bool read(std::string &s) {
+		unsigned long long n;
+		if (!read(n) || n > size - pos)
+			return false;
+		s.resize(n);
+		return raw(&s[0], n);
+	}
+
+private:
+	// Read the next n bytes of the file and skip their padding, false if there are not enough of them
+	bool raw(void *data, size_t n);
+	
+	std::ifstream file;
+	size_t size, pos;
+};
+
+#endif
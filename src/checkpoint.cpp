@@ -0,0 +1,41 @@
+#include "checkpoint.hpp"
+#include "cache.hpp"
+#include <cstdio>
+
+static const std::string CHECKPOINT_MAGIC = "raytracer checkpoint 1";
+
+void Checkpoint::reset(int w, int h) {
+	width = w;
+	height = h;
+	sums.assign(width * height, Vector(0, 0, 0));
+	counts.assign(width * height, 0);
+}
+
+bool Checkpoint::save(const std::string &path, const std::string &key) const {
+	CacheWriter w(path);
+	w.write(CHECKPOINT_MAGIC);
+	w.write((int) sizeof(real));
+	w.write(key);
+	w.write(width);
+	w.write(height);
+	w.write(sums);
+	w.write(counts);
+	return w.commit();
+}
+
+bool Checkpoint::load(const std::string &path, const std::string &key, int w, int h) {
+	CacheReader r(path);
+	std::string magic, saved_key;
+	int real_size;
+	if (!r.good() || !r.read(magic) || magic != CHECKPOINT_MAGIC || !r.read(real_size) || real_size != sizeof(real)
+		|| !r.read(saved_key) || saved_key != key || !r.read(width) || !r.read(height) || width != w || height != h)
+		return false;
+	return r.read(sums) && r.read(counts) && sums.size() == (size_t) width * height && counts.size() == sums.size();
+}
+
+double Checkpoint::meanSamples() const {
+	double total = 0;
+	for (int count : counts)
+		total += count;
+	return counts.empty() ? 0 : total / counts.size();
+}
@@ -0,0 +1,32 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "vector.hpp"
+#include <vector>
+#include <string>
+
+/** Samples taken so far by a render, saved to resume it
+	For each pixel, the sum of the linear colors of its samples (before the gamma correction) and their number.
+	The file is written with CacheWriter under a key made from the inputs and the options of the render, so that
+	a render is only resumed with the same scene and settings.
+*/
+class Checkpoint {
+public:
+	// No samples for an image of width x height pixels
+	void reset(int width, int height);
+	
+	// Write the file atomically (under a unique temporary name first), returns false if it cannot be written
+	bool save(const std::string &path, const std::string &key) const;
+	// Returns false if the file does not exist, is corrupted or was written for another key or image size
+	bool load(const std::string &path, const std::string &key, int width, int height);
+	
+	// Mean color of pixel p, black if it has no samples
+	Vector color(int p) const {return counts[p] > 0 ? (1. / ((double) counts[p])) * sums[p] : Vector(0, 0, 0);}
+	double meanSamples() const; // Mean number of samples per pixel
+	
+	int width = 0, height = 0;
+	std::vector<Vector> sums; // Of pixel (i,j) at i * width + j, i from the bottom of the image
+	std::vector<int> counts;
+};
+
+#endif
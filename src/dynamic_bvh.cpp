@@ -0,0 +1,249 @@
+#include "dynamic_bvh.hpp"
+#include <algorithm>
+#include <utility>
+
+// The tree is built again when updates made its cost larger than this factor times its cost after the last build
+constexpr real REBUILD_FACTOR = 1.5;
+
+void DynamicBVH::build(const std::vector<BBox> &boxes, BVH::Quality quality) {
+	nodes.clear();
+	leaves.assign(boxes.size(), -1);
+	root = -1;
+	free_list = -1;
+	n_primitives = boxes.size();
+	pending_refit = false;
+	built_cost = 0;
+	if (boxes.empty())
+		return;
+	// Build a binary BVH with leaves as small as possible, then split its remaining leaves
+	BVH bvh;
+	bvh.build(boxes, 1, BVH::Settings(quality, 2));
+	nodes.reserve(2 * boxes.size());
+	root = convert(bvh, boxes, 0, -1);
+	built_cost = cost();
+}
+
+int DynamicBVH::convert(const BVH &bvh, const std::vector<BBox> &boxes, unsigned node, int parent) {
+	const BVH::Node &source = bvh.nodes[node];
+	if (source.count > 0)
+		return convertRange(bvh, boxes, source.offset, source.count, parent);
+	int n = allocate();
+	nodes[n].parent = parent;
+	nodes[n].box = source.box;
+	int first = convert(bvh, boxes, node + 1, n);
+	int second = convert(bvh, boxes, source.offset, n);
+	nodes[n].child[0] = first;
+	nodes[n].child[1] = second;
+	nodes[n].height = 1 + std::max(nodes[first].height, nodes[second].height);
+	return n;
+}
+
+int DynamicBVH::convertRange(const BVH &bvh, const std::vector<BBox> &boxes, unsigned first, unsigned count, int parent) {
+	int n = allocate();
+	nodes[n].parent = parent;
+	if (count == 1) {
+		unsigned primitive = bvh.indices[first];
+		nodes[n].box = boxes[primitive];
+		nodes[n].primitive = primitive;
+		leaves[primitive] = n;
+		return n;
+	}
+	// Primitives which the builder could not separate are split in two halves
+	int a = convertRange(bvh, boxes, first, count / 2, n);
+	int b = convertRange(bvh, boxes, first + count / 2, count - count / 2, n);
+	nodes[n].child[0] = a;
+	nodes[n].child[1] = b;
+	nodes[n].box = nodes[a].box;
+	nodes[n].box.extend(nodes[b].box);
+	nodes[n].height = 1 + std::max(nodes[a].height, nodes[b].height);
+	return n;
+}
+
+int DynamicBVH::allocate() {
+	int n;
+	if (free_list >= 0) {
+		n = free_list;
+		free_list = nodes[n].parent;
+	}
+	else {
+		n = nodes.size();
+		nodes.push_back(Node());
+	}
+	nodes[n].parent = -1;
+	nodes[n].child[0] = nodes[n].child[1] = -1;
+	nodes[n].primitive = 0;
+	nodes[n].height = 0;
+	nodes[n].dirty = false;
+	return n;
+}
+
+void DynamicBVH::release(int node) {
+	nodes[node].parent = free_list;
+	nodes[node].child[0] = nodes[node].child[1] = -1;
+	free_list = node;
+}
+
+void DynamicBVH::fitUpwards(int node) {
+	for (; node >= 0; node = nodes[node].parent) {
+		Node &n = nodes[node];
+		n.box = nodes[n.child[0]].box;
+		n.box.extend(nodes[n.child[1]].box);
+		n.height = 1 + std::max(nodes[n.child[0]].height, nodes[n.child[1]].height);
+	}
+}
+
+void DynamicBVH::insert(unsigned primitive, const BBox &box) {
+	if (pending_refit)
+		refit();
+	if (primitive >= leaves.size())
+		leaves.resize(primitive + 1, -1);
+	int leaf = allocate();
+	nodes[leaf].box = box;
+	nodes[leaf].primitive = primitive;
+	leaves[primitive] = leaf;
+	++n_primitives;
+	if (root < 0) {
+		root = leaf;
+		return;
+	}
+	
+	// Go down to the best sibling: the cost of making a node the sibling of the new leaf is the area of
+	// their new parent, plus the increase of the areas of its ancestors (as in Box2D)
+	int sibling = root;
+	while (!isLeaf(sibling)) {
+		const Node &node = nodes[sibling];
+		BBox combined = node.box;
+		combined.extend(box);
+		real here = 2 * combined.area();
+		real inherited = 2 * (combined.area() - node.box.area()); // Paid by the descendants of node
+		real child_cost[2];
+		for (int k = 0; k < 2; k++) {
+			const BBox &child_box = nodes[node.child[k]].box;
+			BBox b = child_box;
+			b.extend(box);
+			child_cost[k] = b.area() + inherited - (isLeaf(node.child[k]) ? 0 : child_box.area());
+		}
+		if (here <= child_cost[0] && here <= child_cost[1])
+			break;
+		sibling = node.child[child_cost[1] < child_cost[0]];
+	}
+	
+	// New parent of the sibling and the leaf
+	int old_parent = nodes[sibling].parent;
+	int parent = allocate();
+	nodes[parent].parent = old_parent;
+	nodes[parent].child[0] = sibling;
+	nodes[parent].child[1] = leaf;
+	nodes[sibling].parent = parent;
+	nodes[leaf].parent = parent;
+	if (old_parent < 0)
+		root = parent;
+	else
+		nodes[old_parent].child[nodes[old_parent].child[1] == sibling] = parent;
+	fitUpwards(parent);
+}
+
+void DynamicBVH::remove(unsigned primitive) {
+	if (pending_refit)
+		refit();
+	int leaf = leaves[primitive];
+	leaves[primitive] = -1;
+	--n_primitives;
+	int parent = nodes[leaf].parent;
+	release(leaf);
+	if (parent < 0) {
+		root = -1;
+		return;
+	}
+	// The sibling takes the place of the parent
+	int sibling = nodes[parent].child[nodes[parent].child[0] == leaf];
+	int grandparent = nodes[parent].parent;
+	nodes[sibling].parent = grandparent;
+	release(parent);
+	if (grandparent < 0)
+		root = sibling;
+	else {
+		nodes[grandparent].child[nodes[grandparent].child[1] == parent] = sibling;
+		fitUpwards(grandparent);
+	}
+}
+
+void DynamicBVH::update(unsigned primitive, const BBox &box) {
+	int node = leaves[primitive];
+	nodes[node].box = box;
+	// Mark the ancestors up to the first one already marked, whose own ancestors are marked too
+	for (node = nodes[node].parent; node >= 0 && !nodes[node].dirty; node = nodes[node].parent)
+		nodes[node].dirty = true;
+	pending_refit = true;
+}
+
+void DynamicBVH::refit() {
+	if (!pending_refit)
+		return;
+	pending_refit = false;
+	if (root < 0 || !nodes[root].dirty)
+		return;
+	// Post-order walk of the dirty nodes, a node being pushed a second time once its children are done
+	std::vector<std::pair<int, bool> > stack;
+	stack.push_back({root, false});
+	while (!stack.empty()) {
+		std::pair<int, bool> entry = stack.back();
+		stack.pop_back();
+		Node &node = nodes[entry.first];
+		if (entry.second) {
+			node.box = nodes[node.child[0]].box;
+			node.box.extend(nodes[node.child[1]].box);
+			node.dirty = false;
+			continue;
+		}
+		stack.push_back({entry.first, true});
+		for (int k = 0; k < 2; k++)
+			if (nodes[node.child[k]].dirty)
+				stack.push_back({node.child[k], false});
+	}
+}
+
+void DynamicBVH::rename(unsigned old_id, unsigned new_id) {
+	if (new_id >= leaves.size())
+		leaves.resize(new_id + 1, -1);
+	int leaf = leaves[old_id];
+	leaves[old_id] = -1;
+	leaves[new_id] = leaf;
+	nodes[leaf].primitive = new_id;
+}
+
+real DynamicBVH::cost() const {
+	if (root < 0 || isLeaf(root))
+		return 0;
+	real sum = 0;
+	std::vector<int> stack(1, root);
+	while (!stack.empty()) {
+		int node = stack.back();
+		stack.pop_back();
+		if (isLeaf(node))
+			continue;
+		sum += nodes[node].box.area();
+		stack.push_back(nodes[node].child[0]);
+		stack.push_back(nodes[node].child[1]);
+	}
+	real root_area = nodes[root].box.area();
+	return root_area > 0 ? sum / root_area : 0;
+}
+
+bool DynamicBVH::degraded() const {
+	return (root >= 0 && nodes[root].height > MAX_DEPTH) || cost() > REBUILD_FACTOR * built_cost;
+}
+
+void DynamicBVH::save(CacheWriter &w) const {
+	w.write(nodes);
+	w.write(leaves);
+	w.write(root);
+	w.write(free_list);
+	w.write(n_primitives);
+	w.write(built_cost);
+}
+
+bool DynamicBVH::load(CacheReader &r) {
+	pending_refit = false;
+	return r.read(nodes) && r.read(leaves) && r.read(root) && r.read(free_list) && r.read(n_primitives) && r.read(built_cost);
+}
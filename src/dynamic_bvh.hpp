@@ -0,0 +1,129 @@
+#ifndef DYNAMIC_BVH_HPP
+#define DYNAMIC_BVH_HPP
+
+#include "vector.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "bvh.hpp"
+#include "cache.hpp"
+#include <vector>
+
+/** Bounding volume hierarchy whose primitives can move, be inserted and removed once it is built
+	Unlike BVH, the binary tree is stored with parent links and one primitive per leaf, so that it can be
+	modified in place: moved primitives only update the boxes of their ancestors (refit), an inserted primitive
+	becomes the sibling of the node for which the SAH cost increases the least, and a removed one is replaced
+	by its sibling. These updates make the tree worse over time, so its SAH cost is compared with the one it
+	had when it was last built to decide when to build it again.
+*/
+class DynamicBVH {
+public:
+	struct Node {
+		BBox box;
+		int parent; // -1 for the root. For a free node, next free node.
+		int child[2]; // -1 for a leaf
+		unsigned primitive; // Primitive of a leaf
+		int height; // Height of the subtree, 0 for a leaf
+		bool dirty; // The box must be recomputed by refit
+	};
+	
+	// Build the tree over the primitives 0..n-1 with the given boxes (with the builder of BVH of the given quality)
+	void build(const std::vector<BBox> &boxes, BVH::Quality quality = BVH::HIGH);
+	
+	// Add a primitive, whose id must not be in the tree
+	void insert(unsigned primitive, const BBox &box);
+	void remove(unsigned primitive);
+	// Change the box of a primitive after it moved. The boxes of its ancestors are updated by the next refit.
+	void update(unsigned primitive, const BBox &box);
+	void refit();
+	// Give the id new_id, which must not be in the tree, to a primitive
+	void rename(unsigned old_id, unsigned new_id);
+	
+	bool empty() const {return root < 0;}
+	bool contains(unsigned primitive) const {return primitive < leaves.size() && leaves[primitive] >= 0;}
+	size_t size() const {return n_primitives;}
+	size_t nodeCount() const {return 2 * n_primitives - (n_primitives > 0);}
+	size_t memory() const {return nodes.size() * sizeof(Node) + leaves.size() * sizeof(int);}
+	
+	// SAH cost of the tree: sum of the areas of the inner nodes divided by the area of the root
+	real cost() const;
+	// True if the tree is too deep to be traversed, or if updates made its cost much larger than when it was built
+	bool degraded() const;
+	
+	// Write the tree to a cache file, and read it back (returns false if the cache is invalid)
+	void save(CacheWriter &w) const;
+	bool load(CacheReader &r);
+	
+	// Visit the primitives whose box is intersected by the ray before t_max, closest nodes first.
+	// For each of them, leaf(primitive, t_max) is called and must return the new t_max. The tree must not
+	// be deeper than MAX_DEPTH, which is the case unless it is degraded.
+	template <class Leaf>
+	void traverse(const Ray &ray, real t_max, Leaf leaf) const;
+	
+	// Maximum depth of the tree, beyond which it is degraded
+	static constexpr int MAX_DEPTH = 128;
+	
+private:
+	int allocate();
+	void release(int node);
+	bool isLeaf(int node) const {return nodes[node].child[0] < 0;}
+	// Recompute the boxes and heights of node and its ancestors from their children
+	void fitUpwards(int node);
+	// Convert the subtree rooted at node of the static tree, whose leaves are split into single primitives
+	int convert(const BVH &bvh, const std::vector<BBox> &boxes, unsigned node, int parent);
+	int convertRange(const BVH &bvh, const std::vector<BBox> &boxes, unsigned first, unsigned count, int parent);
+	
+	std::vector<Node> nodes;
+	std::vector<int> leaves; // Leaf of each primitive id, -1 if it is not in the tree
+	int root = -1;
+	int free_list = -1; // First free node
+	size_t n_primitives = 0;
+	bool pending_refit = false;
+	real built_cost = 0; // Cost when the tree was last built
+};
+
+template <class Leaf>
+void DynamicBVH::traverse(const Ray &ray, real t_max, Leaf leaf) const {
+	if (root < 0)
+		return;
+	Vector inv_dir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	real t_enter;
+	if (!nodes[root].box.intersect(ray.origin, inv_dir, t_max, t_enter))
+		return;
+	// Nodes to visit with the distance at which the ray enters them
+	struct Entry {
+		int node;
+		real t;
+	} stack[MAX_DEPTH + 2];
+	int top = 0;
+	stack[top++] = {root, t_enter};
+	while (top > 0) {
+		Entry entry = stack[--top];
+		if (entry.t > t_max)
+			continue;
+		const Node &node = nodes[entry.node];
+		if (node.child[0] < 0) {
+			t_max = leaf(node.primitive, t_max);
+			continue;
+		}
+		real t0, t1;
+		bool hit0 = nodes[node.child[0]].box.intersect(ray.origin, inv_dir, t_max, t0);
+		bool hit1 = nodes[node.child[1]].box.intersect(ray.origin, inv_dir, t_max, t1);
+		// Push the farthest child first, so that the closest is visited first
+		if (hit0 && hit1) {
+			if (t0 <= t1) {
+				stack[top++] = {node.child[1], t1};
+				stack[top++] = {node.child[0], t0};
+			}
+			else {
+				stack[top++] = {node.child[0], t0};
+				stack[top++] = {node.child[1], t1};
+			}
+		}
+		else if (hit0)
+			stack[top++] = {node.child[0], t0};
+		else if (hit1)
+			stack[top++] = {node.child[1], t1};
+	}
+}
+
+#endif
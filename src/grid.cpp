@@ -0,0 +1,80 @@
+#include "grid.hpp"
+#include <math.h>
+
+// Maximum number of cells along an axis
+constexpr int MAX_RES = 256;
+
+void Grid::build(const std::vector<BBox> &boxes, real density) {
+	cells.clear();
+	indices.clear();
+	box = BBox();
+	if (boxes.empty())
+		return;
+	for (const BBox &b : boxes)
+		box.extend(b);
+	
+	// Resolution: cubic cells, about density cells per primitive
+	Vector d = box.max - box.min;
+	real d_max = (d.maxAbs() > 0) ? d.maxAbs() : 1;
+	// Give flat bounds a minimal thickness so that their volume is not zero
+	d = Vector(std::max(d.x, d_max / MAX_RES), std::max(d.y, d_max / MAX_RES), std::max(d.z, d_max / MAX_RES));
+	box.max = box.min + d;
+	real k = cbrt(density * boxes.size() / (d.x * d.y * d.z));
+	for (int a = 0; a < 3; a++)
+		res[a] = std::max(1, std::min(MAX_RES, (int) ceil(d[a] * k)));
+	cell_size = Vector(d.x / res[0], d.y / res[1], d.z / res[2]);
+	inv_cell_size = Vector(res[0] / d.x, res[1] / d.y, res[2] / d.z);
+	
+	// Boxes are enlarged by the rounding error of the cell computations, so that a primitive is in all the
+	// cells where a ray may hit it
+	real pad = errorGamma(8) * (box.min.maxAbs() + box.max.maxAbs());
+	Vector padding(pad, pad, pad);
+	auto cellRange = [&](const BBox &b, int lo[3], int hi[3]) {
+		for (int a = 0; a < 3; a++) {
+			lo[a] = cellOf(b.min - padding, a);
+			hi[a] = cellOf(b.max + padding, a);
+		}
+	};
+	
+	// Count the primitives of each cell, then fill them (counting sort)
+	cells.assign(cellCount() + 1, 0);
+	int lo[3], hi[3];
+	for (const BBox &b : boxes) {
+		cellRange(b, lo, hi);
+		for (int z = lo[2]; z <= hi[2]; z++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+					++cells[x + res[0] * (y + res[1] * z) + 1];
+	}
+	for (unsigned i = 1; i < cells.size(); i++)
+		cells[i] += cells[i-1];
+	indices.resize(cells.back());
+	std::vector<unsigned> next(cells.begin(), cells.end() - 1);
+	for (unsigned i = 0; i < boxes.size(); i++) {
+		cellRange(boxes[i], lo, hi);
+		for (int z = lo[2]; z <= hi[2]; z++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+					indices[next[x + res[0] * (y + res[1] * z)]++] = i;
+	}
+}
+
+long Grid::emptyCellCount() const {
+	long n = 0;
+	for (unsigned i = 0; i + 1 < cells.size(); i++)
+		n += (cells[i+1] == cells[i]);
+	return n;
+}
+
+void Grid::save(CacheWriter &w) const {
+	w.write(res);
+	w.write(cells);
+	w.write(indices);
+	w.write(box);
+	w.write(cell_size);
+	w.write(inv_cell_size);
+}
+
+bool Grid::load(CacheReader &r) {
+	return r.read(res) && r.read(cells) && r.read(indices) && r.read(box) && r.read(cell_size) && r.read(inv_cell_size);
+}
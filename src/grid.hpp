@@ -0,0 +1,103 @@
+#ifndef GRID_HPP
+#define GRID_HPP
+
+#include "vector.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "cache.hpp"
+#include <vector>
+#include <limits>
+
+/** Uniform grid over a set of primitives known by their bounding boxes
+	Each cell stores the indices of the primitives whose box overlaps it, and rays walk through the cells
+	in order with a 3D-DDA. It is cheaper to build than a BVH and faster to traverse when the primitives are
+	small and spread uniformly, such as the spheres of random scenes.
+*/
+class Grid {
+public:
+	// Build the grid with about density cells per primitive, the resolution along each axis being
+	// proportional to the extent of the bounds along it
+	void build(const std::vector<BBox> &boxes, real density = 4);
+	
+	bool empty() const {return cells.empty();}
+	const BBox &bounds() const {return box;}
+	long cellCount() const {return (long) res[0] * res[1] * res[2];}
+	long emptyCellCount() const;
+	
+	// Write the grid to a cache file, and read it back (returns false if the cache is invalid)
+	void save(CacheWriter &w) const;
+	bool load(CacheReader &r);
+	
+	// Visit the non-empty cells crossed by the ray before t_max, in order. Same interface as BVH::traverse:
+	// leaf(first, count, t_max) is called with the range of the cell in indices and returns the new t_max.
+	// A primitive overlapping several cells may be visited several times.
+	template <class Leaf>
+	void traverse(const Ray &ray, real t_max, Leaf leaf) const;
+	
+	int res[3] = {0, 0, 0}; // Number of cells along each axis
+	std::vector<unsigned> cells; // Range of cell i in indices is [cells[i], cells[i+1])
+	std::vector<unsigned> indices; // Indices of the primitives, cell by cell
+
+private:
+	// Cell of P along axis a, clamped to the grid
+	int cellOf(const Vector &P, int a) const {
+		int c = (int) ((P[a] - box.min[a]) * inv_cell_size[a]);
+		return c < 0 ? 0 : (c >= res[a] ? res[a] - 1 : c);
+	}
+	
+	BBox box;
+	Vector cell_size, inv_cell_size;
+};
+
+template <class Leaf>
+void Grid::traverse(const Ray &ray, real t_max, Leaf leaf) const {
+	if (cells.empty())
+		return;
+	Vector inv_dir(1 / ray.direction.x, 1 / ray.direction.y, 1 / ray.direction.z);
+	real t_enter;
+	if (!box.intersect(ray.origin, inv_dir, t_max, t_enter))
+		return;
+	
+	// Initialize the DDA at the entry point of the grid
+	Vector P = ray.origin + t_enter * ray.direction;
+	int cell[3], step[3], end[3];
+	real t_next[3], t_delta[3];
+	for (int a = 0; a < 3; a++) {
+		cell[a] = cellOf(P, a);
+		if (ray.direction[a] > 0) {
+			step[a] = 1;
+			end[a] = res[a];
+			t_next[a] = (box.min[a] + (cell[a] + 1) * cell_size[a] - ray.origin[a]) * inv_dir[a];
+			t_delta[a] = cell_size[a] * inv_dir[a];
+		}
+		else if (ray.direction[a] < 0) {
+			step[a] = -1;
+			end[a] = -1;
+			t_next[a] = (box.min[a] + cell[a] * cell_size[a] - ray.origin[a]) * inv_dir[a];
+			t_delta[a] = -cell_size[a] * inv_dir[a];
+		}
+		else {
+			step[a] = 0;
+			end[a] = -1;
+			t_next[a] = std::numeric_limits<real>::infinity();
+			t_delta[a] = 0;
+		}
+	}
+	
+	while (true) {
+		unsigned i = cell[0] + res[0] * (cell[1] + res[1] * cell[2]);
+		if (cells[i+1] > cells[i])
+			t_max = leaf(cells[i], cells[i+1] - cells[i], t_max);
+		// Move to the next cell along the axis whose boundary is the closest
+		int a = (t_next[0] < t_next[1]) ? (t_next[0] < t_next[2] ? 0 : 2) : (t_next[1] < t_next[2] ? 1 : 2);
+		// A hit inside the current cell is closer than everything in the next cells
+		if (t_max <= t_next[a])
+			return;
+		cell[a] += step[a];
+		if (cell[a] == end[a])
+			return;
+		t_next[a] += t_delta[a];
+	}
+}
+
+#endif
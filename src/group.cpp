@@ -0,0 +1,71 @@
+#include "group.hpp"
+
+void Group::build(const BVH::Settings &settings) {
+	std::vector<BBox> boxes;
+	for (const Sphere &sphere : spheres) {
+		Vector r(sphere.radius, sphere.radius, sphere.radius);
+		boxes.push_back(BBox(sphere.origin - r, sphere.origin + r));
+	}
+	for (const Mesh &mesh : meshes)
+		boxes.push_back(mesh.bounds());
+	bvh.build(boxes, 2, settings);
+}
+
+Group::Intersection Group::intersect(const Ray &ray, real t_max) const {
+	Intersection inter;
+	inter.t = 0;
+	inter.index = 0;
+	inter.primitive = 0;
+	inter.triangle = false;
+	inter.entrance = false;
+	bvh.traverse(ray, t_max, [&](unsigned first, unsigned count, real t_current) {
+		for (unsigned k = first; k < first + count; k++) {
+			unsigned i = bvh.indices[k];
+			if (i < spheres.size()) {
+				Sphere::Intersection s = spheres[i].intersect(ray);
+				if (s.first > 0 && s.first < t_current) {
+					t_current = s.first;
+					inter.t = s.first;
+					inter.index = i;
+					inter.triangle = false;
+					inter.entrance = s.second;
+				}
+			}
+			else {
+				const Mesh &mesh = meshes[i - spheres.size()];
+				unsigned triangle;
+				real t = mesh.intersect(ray, t_current, triangle);
+				if (t > 0) {
+					t_current = t;
+					inter.t = t;
+					inter.index = i - spheres.size();
+					inter.primitive = triangle;
+					inter.triangle = true;
+					inter.entrance = !mesh.solid || mesh.normal(triangle).sp(ray.direction) < 0;
+				}
+			}
+		}
+		return t_current;
+	});
+	return inter;
+}
+
+void Group::save(CacheWriter &w) const {
+	w.write(name);
+	w.write(spheres);
+	w.write((unsigned long long) meshes.size());
+	for (const Mesh &mesh : meshes)
+		mesh.save(w);
+	bvh.save(w);
+}
+
+bool Group::load(CacheReader &r) {
+	unsigned long long n_meshes;
+	if (!r.read(name) || !r.read(spheres) || !r.read(n_meshes))
+		return false;
+	meshes = std::vector<Mesh>(n_meshes);
+	for (Mesh &mesh : meshes)
+		if (!mesh.load(r))
+			return false;
+	return bvh.load(r);
+}
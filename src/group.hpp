@@ -0,0 +1,57 @@
+#ifndef GROUP_HPP
+#define GROUP_HPP
+
+#include "sphere.hpp"
+#include "mesh.hpp"
+#include "bvh.hpp"
+#include "transform.hpp"
+#include <vector>
+#include <string>
+
+/** Group of spheres and meshes defined once in object coordinates and placed several times in the scene
+	by instances. Its bounding volume hierarchy (the bottom level of the two-level structure of the scene) is
+	shared by all the instances.
+*/
+class Group {
+public:
+	// Closest intersection of a ray with the objects of the group
+	struct Intersection {
+		real t; // 0 if there is no intersection
+		int index; // Index of the sphere, or of the mesh if triangle is true
+		unsigned primitive; // Index of the triangle in its mesh
+		bool triangle;
+		bool entrance;
+	};
+	
+	Group(const std::string &n = "") : name(n) {}
+	
+	// Build the BVH of the group, once all its objects have been added
+	void build(const BVH::Settings &settings = BVH::Settings());
+	
+	// Compute the closest intersection of a ray (in object coordinates) with the group before t_max
+	Intersection intersect(const Ray &ray, real t_max) const;
+	
+	const BBox &bounds() const {return bvh.bounds();}
+	
+	// Write the group with its BVH to a cache file, and read it back (returns false if the cache is invalid)
+	void save(CacheWriter &w) const;
+	bool load(CacheReader &r);
+	
+	std::string name;
+	std::vector<Sphere> spheres;
+	std::vector<Mesh> meshes;
+	BVH bvh; // Over the spheres, then the meshes
+};
+
+/** Instance of a group in the scene */
+class Instance {
+public:
+	Instance() : group(0), transform(), rx(0), ry(0), rz(0) {} // Read from cache files
+	Instance(int g, const Transform &t, real x = 0, real y = 0, real z = 0) : group(g), transform(t), rx(x), ry(y), rz(z) {}
+	
+	int group; // Index of the group in the scene
+	Transform transform; // From the coordinates of the group to the world
+	real rx, ry, rz; // Rotation angles of the specification
+};
+
+#endif
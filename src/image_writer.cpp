@@ -0,0 +1,75 @@
+#include "image_writer.hpp"
+#include <vector>
+#include <algorithm>
+#include <strings.h>
+
+ImageWriter::Format ImageWriter::format(const std::string &path) {
+	size_t dot = path.find_last_of('.');
+	if (dot == std::string::npos || path.find('/', dot) != std::string::npos)
+		return NONE;
+	const char *ext = path.c_str() + dot + 1;
+	if (!strcasecmp(ext, "bmp"))
+		return BMP;
+	if (!strcasecmp(ext, "ppm") || !strcasecmp(ext, "pgm") || !strcasecmp(ext, "pnm"))
+		return PPM;
+	return NONE;
+}
+
+bool ImageWriter::open(const std::string &path, int w, int h) {
+	close();
+	fmt = format(path);
+	if (fmt == NONE || w <= 0 || h <= 0 || !(file = std::fopen(path.c_str(), "wb")))
+		return false;
+	width = w;
+	height = h;
+	next_row = 0;
+	failed = false;
+	if (fmt == BMP) { // Header of 54 bytes, little endian, rows of 24 bit BGR padded to 4 bytes
+		unsigned char header[54] = {0};
+		const unsigned align = (4 - (3*width) % 4) % 4, buf_size = (3*width + align) * height, file_size = 54 + buf_size;
+		auto put = [&](int offset, unsigned value) {
+			for (int k = 0; k < 4; k++)
+				header[offset + k] = (value >> (8*k)) & 0xFF;
+		};
+		header[0] = 'B';
+		header[1] = 'M';
+		put(0x02, file_size);
+		header[0x0A] = 0x36;
+		header[0x0E] = 0x28;
+		put(0x12, width);
+		put(0x16, height);
+		header[0x1A] = 1;
+		header[0x1C] = 24;
+		put(0x22, buf_size);
+		header[0x27] = 0x1;
+		header[0x2B] = 0x1;
+		failed = std::fwrite(header, 1, sizeof(header), file) != sizeof(header);
+	}
+	else // The values are at most 255
+		failed = std::fprintf(file, "P6\n%u %u\n255\n", width, height) < 0;
+	return !failed;
+}
+
+void ImageWriter::write(const int *img, int count) {
+	if (!file)
+		return;
+	count = std::min(count, height - next_row);
+	const int align = fmt == BMP ? (4 - (3*width) % 4) % 4 : 0;
+	std::vector<unsigned char> row(3*width + align, 0);
+	for (int r = next_row; r < next_row + count; r++) {
+		const int *pixels = img + (fmt == BMP ? height - r - 1 : r) * width;
+		for (int j = 0; j < width; j++)
+			for (int c = 0; c < 3; c++) // BMP stores BGR
+				row[3*j + c] = (unsigned char) pixels[j + (fmt == BMP ? 2 - c : c) * height * width];
+		failed = std::fwrite(row.data(), 1, row.size(), file) != row.size() || failed;
+	}
+	next_row += count;
+}
+
+bool ImageWriter::close() {
+	if (!file)
+		return true;
+	failed = std::fclose(file) != 0 || failed;
+	file = nullptr;
+	return !failed;
+}
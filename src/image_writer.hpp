@@ -0,0 +1,45 @@
+#ifndef IMAGE_WRITER_HPP
+#define IMAGE_WRITER_HPP
+
+#include <string>
+#include <cstdio>
+
+/** 8 bit RGB image file written by bands of rows while the image is rendered
+	The rows are written in the order in which the file stores them: from the bottom of the image for BMP files,
+	from the top for PPM files (extensions .ppm, .pgm and .pnm, written as binary PPM). The files are the same
+	as the ones saved by CImg. The other formats are not streamed, the whole image is then saved by CImg.
+*/
+class ImageWriter {
+public:
+	enum Format : unsigned char {NONE, BMP, PPM};
+	
+	ImageWriter() {}
+	~ImageWriter() {close();}
+	ImageWriter(const ImageWriter&) = delete;
+	ImageWriter &operator=(const ImageWriter&) = delete;
+	
+	// Format of a file by its extension, NONE if it is not streamed
+	static Format format(const std::string &path);
+	
+	// Create the file of an image of width x height pixels and write its header. Returns false if the format is
+	// not streamed or the file cannot be created.
+	bool open(const std::string &path, int width, int height);
+	bool isOpen() const {return file != nullptr;}
+	bool bottomUp() const {return fmt == BMP;} // The first rows of the file are the bottom of the image
+	
+	// Write the next count rows of the file, taken from the planar image img (rows from the top, as in CImg)
+	void write(const int *img, int count);
+	int rowsWritten() const {return next_row;}
+	
+	// Close the file, returns false if a write failed
+	bool close();
+	
+private:
+	std::FILE *file = nullptr;
+	Format fmt = NONE;
+	int width = 0, height = 0;
+	int next_row = 0; // Number of rows of the file written so far
+	bool failed = false;
+};
+
+#endif
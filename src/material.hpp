@@ -7,20 +7,20 @@
 
 class Material {
 public:
-	Material(double r = 1, double g = 1, double b = 1, double d = 1.
-			 , double s = 0, double sr = 1, double sg = 1, double sb = 1
-			 , double re = 0, double rer = 1, double reg = 1, double reb = 1
-			 , double ind = 1) 
+	Material(real r = 1, real g = 1, real b = 1, real d = 1.
+			 , real s = 0, real sr = 1, real sg = 1, real sb = 1
+			 , real re = 0, real rer = 1, real reg = 1, real reb = 1
+			 , real ind = 1) 
 		: color(r,g,b), diffusion_coeff(d), specularity(s), spec_color(sr,sg,sb)
 		, refraction(re), refr_color(rer, reg, reb), refr_index(ind){}
 	
 	Vector color; // Color of the object
-	double diffusion_coeff; // Intensity of light diffusion of the material
-	double specularity; // Probability that a ray is reflected
+	real diffusion_coeff; // Intensity of light diffusion of the material
+	real specularity; // Probability that a ray is reflected
 	Vector spec_color; // Color of specularity
-	double refraction; // specularity+refraction should be <= 1
+	real refraction; // specularity+refraction should be <= 1
 	Vector refr_color; // Color of refraction
-	double refr_index; // Refractive index of the material
+	real refr_index; // Refractive index of the material
 	
 	bool operator==(const Material &mat) const {
 		return (mat.color == color && mat.diffusion_coeff == diffusion_coeff
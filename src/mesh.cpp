@@ -0,0 +1,181 @@
+#include "mesh.hpp"
+#include <math.h>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <limits>
+
+// Triangles of a leaf are intersected by batches of this size, in a loop the compiler can vectorize
+constexpr int LEAF_BATCH = 8;
+
+bool Mesh::load(const std::string &path, const Vector &pos, real s, const BVH::Settings &settings) {
+	position = pos;
+	scale = s;
+	std::ifstream in(path, std::ios::binary);
+	if (!in) {
+		ErrorMessage() << "cannot open mesh file " << path;
+		return false;
+	}
+	std::stringstream buffer;
+	buffer << in.rdbuf();
+	std::string content = buffer.str();
+	
+	// Parse the file line by line, with strtod/strtol since meshes can have millions of triangles
+	vertices.clear();
+	triangles.clear();
+	const char *c = content.c_str();
+	const char *end = c + content.size();
+	unsigned n_line = 0;
+	std::vector<unsigned> face;
+	while (c < end) {
+		++n_line;
+		const char *eol = c;
+		while (eol < end && *eol != '\n')
+			++eol;
+		if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) { // Vertex
+			char *next;
+			double x = strtod(c + 2, &next);
+			double y = strtod(next, &next);
+			double z = strtod(next, &next);
+			vertices.push_back(position + scale * Vector(x, y, z));
+		}
+		else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) { // Face, of the form "f v1[/vt1[/vn1]] v2..."
+			face.clear();
+			const char *p = c + 2;
+			while (p < eol) {
+				char *next;
+				long v = strtol(p, &next, 10);
+				if (next == p)
+					break;
+				// Negative indices are relative to the last vertex
+				long index = (v < 0) ? (long) vertices.size() + v : v - 1;
+				if (v == 0 || index < 0 || index >= (long) vertices.size()) {
+					ErrorMessage() << "invalid vertex index at line " << n_line << " of file " << path;
+					return false;
+				}
+				face.push_back(index);
+				p = next;
+				while (p < eol && *p != ' ' && *p != '\t') // Skip texture and normal indices
+					++p;
+			}
+			// Triangulate the polygon as a fan, skipping degenerate triangles
+			for (unsigned i = 2; i < face.size(); i++) {
+				Triangle t = {{face[0], face[i-1], face[i]}};
+				const Vector &A = vertices[t.v[0]];
+				if ((vertices[t.v[1]] - A).vp(vertices[t.v[2]] - A).snorm() > 0)
+					triangles.push_back(t);
+			}
+		}
+		c = eol + 1;
+	}
+	if (triangles.empty()) {
+		ErrorMessage() << "no triangle in mesh file " << path;
+		return false;
+	}
+	
+	// Build the BVH and store the triangles in leaf order
+	std::vector<BBox> boxes(triangles.size());
+	for (unsigned i = 0; i < triangles.size(); i++)
+		for (int k = 0; k < 3; k++)
+			boxes[i].extend(vertices[triangles[i].v[k]]);
+	bvh.build(boxes, LEAF_BATCH, settings);
+	std::vector<Triangle> ordered(triangles.size());
+	for (unsigned i = 0; i < triangles.size(); i++)
+		ordered[i] = triangles[bvh.indices[i]];
+	triangles.swap(ordered);
+	bvh.indices = std::vector<unsigned>(); // The leaves now directly refer to ranges of triangles
+	return true;
+}
+
+void Mesh::save(CacheWriter &w) const {
+	w.write(vertices);
+	w.write(triangles);
+	bvh.save(w);
+	w.write(material);
+	w.write(solid);
+	w.write(file);
+	w.write(position);
+	w.write(scale);
+}
+
+bool Mesh::load(CacheReader &r) {
+	return r.read(vertices) && r.read(triangles) && bvh.load(r) && r.read(material) && r.read(solid) && r.read(file)
+		&& r.read(position) && r.read(scale);
+}
+
+real Mesh::intersect(const Ray &ray, real t_max, unsigned &triangle) const {
+	real t = t_max;
+	bvh.traverse(ray, t_max, [&](unsigned first, unsigned count, real t_current) {
+		t_current = intersectLeaf(ray, first, count, t_current, triangle);
+		t = t_current;
+		return t_current;
+	});
+	return (t < t_max) ? t : 0;
+}
+
+real Mesh::intersectLeaf(const Ray &ray, unsigned first, unsigned count, real t_max, unsigned &triangle) const {
+	for (unsigned base = first; base < first + count; base += LEAF_BATCH) {
+		unsigned n = std::min((unsigned) LEAF_BATCH, first + count - base);
+		// Gather the batch in structure of arrays form (missing triangles are degenerate and never hit)
+		real v0x[LEAF_BATCH] = {0}, v0y[LEAF_BATCH] = {0}, v0z[LEAF_BATCH] = {0};
+		real e1x[LEAF_BATCH] = {0}, e1y[LEAF_BATCH] = {0}, e1z[LEAF_BATCH] = {0};
+		real e2x[LEAF_BATCH] = {0}, e2y[LEAF_BATCH] = {0}, e2z[LEAF_BATCH] = {0};
+		for (unsigned k = 0; k < n; k++) {
+			const Triangle &tri = triangles[base + k];
+			const Vector &A = vertices[tri.v[0]], &B = vertices[tri.v[1]], &C = vertices[tri.v[2]];
+			v0x[k] = A.x; v0y[k] = A.y; v0z[k] = A.z;
+			e1x[k] = B.x - A.x; e1y[k] = B.y - A.y; e1z[k] = B.z - A.z;
+			e2x[k] = C.x - A.x; e2y[k] = C.y - A.y; e2z[k] = C.z - A.z;
+		}
+		
+		// Moller-Trumbore test on all the triangles of the batch
+		const real dx = ray.direction.x, dy = ray.direction.y, dz = ray.direction.z;
+		const real ox = ray.origin.x, oy = ray.origin.y, oz = ray.origin.z;
+		real ts[LEAF_BATCH];
+		#pragma omp simd
+		for (int k = 0; k < LEAF_BATCH; k++) {
+			real px = dy * e2z[k] - dz * e2y[k];
+			real py = dz * e2x[k] - dx * e2z[k];
+			real pz = dx * e2y[k] - dy * e2x[k];
+			real det = e1x[k] * px + e1y[k] * py + e1z[k] * pz;
+			real inv_det = 1 / det;
+			real sx = ox - v0x[k], sy = oy - v0y[k], sz = oz - v0z[k];
+			real u = (sx * px + sy * py + sz * pz) * inv_det;
+			real qx = sy * e1z[k] - sz * e1y[k];
+			real qy = sz * e1x[k] - sx * e1z[k];
+			real qz = sx * e1y[k] - sy * e1x[k];
+			real v = (dx * qx + dy * qy + dz * qz) * inv_det;
+			real t = (e2x[k] * qx + e2y[k] * qy + e2z[k] * qz) * inv_det;
+			bool hit = (det != 0) & (u >= 0) & (v >= 0) & (u + v <= 1) & (t > 0);
+			ts[k] = hit ? t : std::numeric_limits<real>::infinity();
+		}
+		for (unsigned k = 0; k < n; k++) {
+			if (ts[k] < t_max) {
+				t_max = ts[k];
+				triangle = base + k;
+			}
+		}
+	}
+	return t_max;
+}
+
+Vector Mesh::normal(unsigned triangle) const {
+	const Triangle &tri = triangles[triangle];
+	const Vector &A = vertices[tri.v[0]];
+	return (vertices[tri.v[1]] - A).vp(vertices[tri.v[2]] - A).normalize();
+}
+
+Vector Mesh::reproject(unsigned triangle, const Vector &P) const {
+	Vector n = normal(triangle);
+	return P - (P - vertices[triangles[triangle].v[0]]).sp(n) * n;
+}
+
+real Mesh::errorBound(unsigned triangle, const Vector &P) const {
+	// Besides the error on P, the error of the intersection test grows with the size of the triangle relative
+	// to its area (thin triangles)
+	const Triangle &tri = triangles[triangle];
+	const Vector &A = vertices[tri.v[0]];
+	Vector e1 = vertices[tri.v[1]] - A, e2 = vertices[tri.v[2]] - A;
+	real shape = e1.norm() * e2.norm() / e1.vp(e2).norm();
+	return errorGamma(8) * (3 * P.maxAbs() + 3 * A.maxAbs() + 4 * shape * (e1.maxAbs() + e2.maxAbs()));
+}
@@ -0,0 +1,67 @@
+#ifndef MESH_HPP
+#define MESH_HPP
+
+#include "vector.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "bvh.hpp"
+#include "utils.hpp"
+#include <vector>
+#include <string>
+
+/** Triangle mesh loaded from a Wavefront OBJ file
+	Vertices are shared between triangles (indexed layout). Triangles are reordered in the leaf order of the BVH
+	of the mesh, so that each leaf is a contiguous range of triangles.
+	A mesh with a transparent material is a solid whose outside is given by the winding of its triangles
+	(counterclockwise seen from outside, as in OBJ files). Other meshes are two-sided surfaces.
+*/
+class Mesh {
+public:
+	struct Triangle {
+		unsigned v[3]; // Indices of the vertices
+	};
+	
+	Mesh() : material(0), solid(false), position(), scale(1) {}
+	
+	// Load the OBJ file path (only vertices and faces are used, polygons being triangulated), with its vertices
+	// scaled by scale and translated by position, and build the BVH with the given settings. Returns false if the
+	// file cannot be loaded.
+	bool load(const std::string &path, const Vector &position, real scale, const BVH::Settings &settings = BVH::Settings());
+	
+	// Returns the distance of the closest intersection of the ray with the mesh before t_max, or 0 if there
+	// is none, and sets triangle to the index of the intersected triangle
+	real intersect(const Ray &ray, real t_max, unsigned &triangle) const;
+	
+	const BBox &bounds() const {return bvh.bounds();}
+	
+	// Write the mesh with its BVH to a cache file, and read it back (returns false if the cache is invalid)
+	void save(CacheWriter &w) const;
+	bool load(CacheReader &r);
+	
+	// Unit normal of a triangle according to its winding
+	Vector normal(unsigned triangle) const;
+	
+	// Project a computed intersection point back onto the plane of the triangle
+	Vector reproject(unsigned triangle, const Vector &P) const;
+	
+	// Bound on the distance between a reprojected point P and the triangle, and on the error of the
+	// intersection test for rays starting close to P (see Sphere::errorBound)
+	real errorBound(unsigned triangle, const Vector &P) const;
+	
+	std::vector<Vector> vertices;
+	std::vector<Triangle> triangles;
+	BVH bvh;
+	unsigned short material; // Index in the material table of the scene
+	bool solid; // True if the mesh is the boundary of a solid (transparent material)
+	
+	/* Specification in the scene file */
+	std::string file;
+	Vector position;
+	real scale;
+	
+private:
+	// Intersect the ray with the triangles [first, first+count), returns the new t_max
+	real intersectLeaf(const Ray &ray, unsigned first, unsigned count, real t_max, unsigned &triangle) const;
+};
+
+#endif
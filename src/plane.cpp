@@ -0,0 +1,14 @@
+#include "plane.hpp"
+#include <limits>
+
+Plane::Intersection Plane::intersect(const Ray &ray) const {
+	real dist = normal.sp(ray.origin) - offset; // Signed distance of the origin of the ray to the plane
+	real t = -dist / normal.sp(ray.direction);
+	if (t > 0 && t < std::numeric_limits<real>::infinity()) // False if the ray is parallel to the plane
+		return Plane::Intersection(t, dist > 0);
+	return Plane::Intersection(0, false);
+}
+
+Vector Plane::reproject(const Vector &P) const {
+	return P - (normal.sp(P) - offset) * normal;
+}
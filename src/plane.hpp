@@ -0,0 +1,39 @@
+#ifndef PLANE_HPP
+#define PLANE_HPP
+
+#include "vector.hpp"
+#include "ray.hpp"
+#include "utils.hpp"
+#include <utility>
+#include <cmath>
+
+/** Plane bounding an opaque half-space
+	The points X such that normal.X < offset are inside the half-space, the normal pointing to the visible side.
+	This is what the room walls of the scenes are, and it is cheaper and more precise than a huge sphere.
+*/
+class Plane {
+public:
+	/* Constructors */
+	Plane() : normal(0,0,1), offset(0), material(0) {}
+	// Plane going through the point P with the given normal (not necessarily normalized)
+	Plane(Vector P, Vector n, unsigned short m = 0) : normal(n.normalize()), offset(normal.sp(P)), material(m) {}
+	
+	typedef std::pair<real, bool> Intersection;
+	
+	// Returns 0 if no intersection and t such that C + t.V is the intersection otherwise.
+	// If t > 0 then returns also true if the ray is entering the half-space
+	Intersection intersect(const Ray &ray) const;
+	
+	// Project a computed intersection point back onto the plane
+	Vector reproject(const Vector &P) const;
+	
+	// Bound on the distance between a reprojected point P and the exact plane, and on the error of the
+	// intersection test for rays starting close to P (see Sphere::errorBound)
+	real errorBound(const Vector &P) const {return errorGamma(8) * (3 * P.maxAbs() + std::abs(offset));}
+	
+	Vector normal;
+	real offset;
+	unsigned short material; // Index in the material table of the scene
+};
+
+#endif
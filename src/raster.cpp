@@ -0,0 +1,111 @@
+#include "raster.hpp"
+#include "scheduler.hpp"
+#include <math.h>
+#include <sstream>
+#include <algorithm>
+
+void SphereRaster::build(const std::vector<Sphere> &spheres, const Vector &cam, real f, int width, int height, int size) {
+	camera = cam;
+	focal = f;
+	tile_size = size;
+	// Tiles around the pixel centers, which are at (j + 0.5 - width/2, i + 0.5 - height/2)
+	x_min = -(width / 2) - tile_size;
+	y_min = -(height / 2) - tile_size;
+	res[0] = (width + size - 1) / size + 2;
+	res[1] = (height + size - 1) / size + 2;
+	
+	// Range of tiles of each sphere: lo > hi if it cannot be hit by the covered rays, or lo[0] < 0 if it is
+	// tested by every ray
+	const int EVERYWHERE = -1;
+	std::vector<int> ranges(4 * spheres.size());
+	std::vector<real> sphere_distances(spheres.size());
+	Scheduler::global().parallelFor(0, spheres.size(), 16384, [&](unsigned first, unsigned last) {
+		for (unsigned k = first; k < last; k++) {
+			int *lo = &ranges[4*k], *hi = &ranges[4*k + 2];
+			const Sphere &sphere = spheres[k];
+			// The radius is enlarged by the error of the intersection test
+			double r = sphere.radius + sphere.errorBound() + errorGamma(8) * camera.maxAbs();
+			double x = sphere.origin.x - camera.x, y = sphere.origin.y - camera.y, depth = camera.z - sphere.origin.z;
+			sphere_distances[k] = (sqrt(x * x + y * y + depth * depth) - r) * (1 - errorGamma(8));
+			if (depth + r < 0) { // Behind the camera
+				lo[0] = 1;
+				hi[0] = 0;
+				continue;
+			}
+			if (depth - r <= 0) { // Crosses the plane of the camera, its projection is not bounded
+				lo[0] = EVERYWHERE;
+				continue;
+			}
+			// Bounds of the ellipse along each axis, from the planes through the camera tangent to the sphere
+			double p[2] = {x, y}, min[2] = {x_min, y_min};
+			for (int a = 0; a < 2; a++) {
+				double center = atan2(p[a], depth), half = asin(r / sqrt(p[a] * p[a] + depth * depth));
+				double s0 = focal * tan(center - half) - 1, s1 = focal * tan(center + half) + 1;
+				lo[a] = (int) std::max(floor((s0 - min[a]) / tile_size), -1.);
+				hi[a] = (int) std::min(floor((s1 - min[a]) / tile_size), (double) res[a]);
+				if (hi[a] < 0 || lo[a] >= res[a]) {
+					lo[0] = 1;
+					hi[0] = 0;
+					break;
+				}
+				lo[a] = std::max(lo[a], 0);
+				hi[a] = std::min(hi[a], res[a] - 1);
+			}
+		}
+	});
+	
+	// The spheres tested everywhere first, then the spheres of each tile (counting sort)
+	n_everywhere = 0;
+	cells.assign(tileCount() + 1, 0);
+	for (unsigned k = 0; k < spheres.size(); k++) {
+		const int *lo = &ranges[4*k], *hi = &ranges[4*k + 2];
+		if (lo[0] == EVERYWHERE)
+			++n_everywhere;
+		else if (lo[0] <= hi[0])
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++)
+					++cells[x + res[0] * y + 1];
+	}
+	cells[0] = n_everywhere;
+	for (unsigned i = 1; i < cells.size(); i++)
+		cells[i] += cells[i-1];
+	indices.resize(cells.back());
+	distances.resize(cells.back());
+	std::vector<unsigned> next(cells.begin(), cells.end() - 1);
+	unsigned everywhere = 0;
+	for (unsigned k = 0; k < spheres.size(); k++) {
+		const int *lo = &ranges[4*k], *hi = &ranges[4*k + 2];
+		if (lo[0] == EVERYWHERE) {
+			distances[everywhere] = sphere_distances[k];
+			indices[everywhere++] = k;
+		}
+		else if (lo[0] <= hi[0])
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int x = lo[0]; x <= hi[0]; x++) {
+					distances[next[x + res[0] * y]] = sphere_distances[k];
+					indices[next[x + res[0] * y]++] = k;
+				}
+	}
+	
+	// Spheres of each tile by distance
+	Scheduler::global().parallelFor(0, tileCount(), 16, [&](unsigned first, unsigned last) {
+		std::vector<std::pair<real, unsigned> > tile;
+		for (unsigned i = first; i < last; i++) {
+			tile.clear();
+			for (unsigned k = cells[i]; k < cells[i+1]; k++)
+				tile.push_back({distances[k], indices[k]});
+			std::sort(tile.begin(), tile.end());
+			for (unsigned k = cells[i]; k < cells[i+1]; k++) {
+				distances[k] = tile[k - cells[i]].first;
+				indices[k] = tile[k - cells[i]].second;
+			}
+		}
+	});
+}
+
+std::string SphereRaster::info() const {
+	std::stringstream s;
+	s << tileCount() << " tiles with " << (double) (indices.size() - n_everywhere) / std::max(tileCount(), 1)
+	  << " spheres on average, " << n_everywhere << " spheres tested by every camera ray";
+	return s.str();
+}
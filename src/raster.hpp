@@ -0,0 +1,66 @@
+#ifndef RASTER_HPP
+#define RASTER_HPP
+
+#include "vector.hpp"
+#include "ray.hpp"
+#include "sphere.hpp"
+#include <vector>
+#include <string>
+
+/** Spheres rasterized on the screen of the camera, to find the closest hits of the camera rays
+	The camera is a pinhole looking down -z, with its screen at distance focal: a camera ray of direction d goes
+	through the point (d.x, d.y) * focal / -d.z of the screen, in pixels from its center. Each sphere in front of the
+	camera projects to an ellipse, whose bounding rectangle (enlarged by a pixel for the rounding errors) is binned
+	into the square tiles of the screen which it overlaps. A camera ray then only needs to test the spheres of the
+	tile it goes through, and the few spheres which are not in front of the camera (they contain it or cross the
+	plane of the screen), which are tested by every ray.
+	The spheres of each tile are sorted by their distance to the camera, so that a ray stops at the first sphere
+	farther than its closest hit, as a depth test would.
+	The tiles cover the image with a margin of one tile, for the rays of antialiasing which leave their pixel. The
+	other rays, and the rays which do not start from the camera, are not covered.
+*/
+class SphereRaster {
+public:
+	// Bin the spheres seen from the camera in the tiles of tile_size pixels of an image of width x height pixels
+	void build(const std::vector<Sphere> &spheres, const Vector &camera, real focal, int width, int height, int tile_size);
+	
+	bool empty() const {return cells.empty();}
+	int tileCount() const {return res[0] * res[1];}
+	std::string info() const; // Mean number of spheres per tile, and number of spheres tested by every ray
+	
+	// Visit the spheres which the ray (with a normalized direction) may hit before t_max, with the interface of
+	// Grid::traverse: leaf(first, count, t_max) is called with ranges of indices and returns the new t_max.
+	// Returns false without visiting anything if the ray is not covered by the raster.
+	template <class Leaf>
+	bool traverse(const Ray &ray, real t_max, Leaf leaf) const;
+	
+	int res[2] = {0, 0}; // Number of tiles along x and y
+	std::vector<unsigned> cells; // Range of tile i in indices is [cells[i], cells[i+1])
+	std::vector<unsigned> indices; // Indices of the spheres tested by every ray, then of the spheres of each tile
+	std::vector<real> distances; // Lower bound of the distance from the camera to the sphere of each index
+	unsigned n_everywhere = 0; // Number of spheres tested by every ray, at the beginning of indices
+	
+private:
+	Vector camera;
+	double focal = 1;
+	double x_min = 0, y_min = 0; // Corner of the first tile on the screen
+	double tile_size = 1;
+};
+
+template <class Leaf>
+bool SphereRaster::traverse(const Ray &ray, real t_max, Leaf leaf) const {
+	if (cells.empty() || !(ray.origin == camera) || !(ray.direction.z < 0))
+		return false;
+	double scale = focal / -ray.direction.z;
+	double x = (ray.direction.x * scale - x_min) / tile_size, y = (ray.direction.y * scale - y_min) / tile_size;
+	if (!(x >= 0 && x < res[0] && y >= 0 && y < res[1]))
+		return false;
+	unsigned i = (int) x + res[0] * (int) y;
+	if (n_everywhere > 0)
+		t_max = leaf(0, n_everywhere, t_max);
+	for (unsigned k = cells[i]; k < cells[i+1] && distances[k] < t_max; k++)
+		t_max = leaf(k, 1, t_max);
+	return true;
+}
+
+#endif
@@ -3,16 +3,23 @@
 #include <algorithm>
 #include <fstream>
 #include <sstream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <cstdio>
 
 #include "vector.hpp"
 #include "ray.hpp"
 #include "sphere.hpp"
 #include "utils.hpp"
 #include "scene.hpp"
+#include "cache.hpp"
+#include "animation.hpp"
+#include "scheduler.hpp"
+#include "checkpoint.hpp"
+#include "renderer.hpp"
 #include <boost/program_options.hpp>
-#include <boost/progress.hpp>
-
-#include "CImg.h"
 
 int main(int argc, char *argv[]) {
 	namespace po = boost::program_options;
@@ -29,6 +36,25 @@ int main(int argc, char *argv[]) {
 	bool antialiasing = true;
 	bool diffuse = true;
 	bool deterministic = false;
+	double prune_weight = 0.001;
+	long max_rays = 100000;
+	double planes_min_radius = 0;
+	std::string accel = "auto";
+	std::string build_quality = "balanced";
+	int bvh_width = 4;
+	bool bvh_compress = false;
+	std::string cache_dir = "";
+	std::string checkpoint_file = "";
+	double checkpoint_interval = 60;
+	bool resume = false;
+	std::string animation_file = "";
+	int n_frames = 0;
+	int n_threads = 0;
+	std::string affinity = "none";
+	bool wavefront = false;
+	bool sort_rays = false;
+	bool packets = true;
+	bool rasterize = false;
 	bool random_scene = false;
 	
     // Parameters for random scene generation
@@ -58,6 +84,25 @@ int main(int argc, char *argv[]) {
 			("no-antialiasing", "Disable antialiasing")
 			("no-diffuse", "Disable diffusion")
 			("deterministic", "Disable random choice between bouncing and refraction")
+			("prune-weight", po::value<double>(&prune_weight), "In deterministic mode, drop the rays whose contribution to the pixel is less than this (default: 0.001)")
+			("max-rays", po::value<long>(&max_rays), "In deterministic mode, maximum number of secondary rays per camera ray, 0 for no limit (default: 100000)")
+			("spheres-to-planes", po::value<double>(&planes_min_radius), "Convert the opaque spheres of at least this radius not containing the camera (walls) to planes, 0 to disable (default: 0)")
+			("accel", po::value<std::string>(&accel), "Acceleration structure for the spheres: linear, grid, bvh, dynamic (BVH which can be updated when the spheres are edited) or auto to choose from the scene (default: auto)")
+			("build-quality", po::value<std::string>(&build_quality), "Quality of the BVHs: fast (parallel Morton code build), balanced (Morton code top levels and SAH subtrees in parallel) or high (SAH on one thread) (default: balanced)")
+			("bvh-width", po::value<int>(&bvh_width), "Number of children of the BVH nodes: 2, or 4 or 8 for wide nodes tested with SIMD instructions (default: 4)")
+			("cache-dir", po::value<std::string>(&cache_dir), "Directory where the loaded scenes with their acceleration structures are cached, to be reused by the next runs with the same scene and build options")
+			("checkpoint", po::value<std::string>(&checkpoint_file), "File where the samples taken so far are saved periodically and when the program is interrupted (SIGINT or SIGTERM, which also write a preview image in the checkpoint file name followed by .bmp), to resume the render later")
+			("checkpoint-interval", po::value<double>(&checkpoint_interval), "Minimum time in seconds between two checkpoints (default: 60)")
+			("resume", "Resume the render from the samples saved in the checkpoint file")
+			("wavefront", "Trace the rays of each tile together, by stages over queues of rays (extend, shade by kind of material, shadow), instead of one ray tree after the other. Better for scenes with many bounces.")
+			("sort-rays", "With --wavefront, reorder the secondary rays by direction octant and position of their origin before tracing them, so that consecutive rays use the same parts of the scene")
+			("no-packets", "Trace the camera rays and the shadow rays one by one, instead of by packets of neighbouring rays traversing the BVH of the spheres together")
+			("raster", "Hybrid rendering: the spheres are projected on the screen once per frame and binned by tile of 16x16 pixels, and the camera rays search their closest sphere only among those of their tile, instead of in the acceleration structure")
+			("bvh-compress", "Quantize the boxes of the wide BVH nodes to 8 bits, which halves the memory of the BVHs")
+			("animation", po::value<std::string>(&animation_file), "Animation file with keyframes of the camera, light and spheres: renders its frames to files named after the output file with the frame number (e.g. frame%04d.bmp), or to the standard output as raw RGB video with -o -")
+			("frames", po::value<int>(&n_frames), "Number of frames of the animation (default: until its last keyframe)")
+			("threads", po::value<int>(&n_threads), "Number of threads (default: number of CPUs the program may run on)")
+			("affinity", po::value<std::string>(&affinity), "Pinning of the threads to the CPUs: none, compact (filling the NUMA nodes one after the other) or scatter (spreading the threads over the nodes). Threads pinned on several nodes render from a copy of the scene on their own node (default: none)")
 			;
 		
 		po::options_description opt_random_scene("Options for random scene generation");
@@ -105,6 +150,18 @@ int main(int argc, char *argv[]) {
 			diffuse = false;
 		if (vm.count("deterministic"))
 			deterministic = true;
+		if (vm.count("bvh-compress"))
+			bvh_compress = true;
+		if (vm.count("wavefront"))
+			wavefront = true;
+		if (vm.count("sort-rays"))
+			sort_rays = true;
+		if (vm.count("no-packets"))
+			packets = false;
+		if (vm.count("raster"))
+			rasterize = true;
+		if (vm.count("resume"))
+			resume = true;
 		
 		po::notify(vm);		
 	}
@@ -114,10 +171,6 @@ int main(int argc, char *argv[]) {
 	}
 	
 	fov *= PI / 180.;
-	double gamma = 2.2; // Gamma correction coefficient
-	
-	/* Image initialization */
-	int *img = (int*)malloc(3 * height * width * sizeof(int));
 	
 	Vector camera(0,0,0);
 	Vector light(0,0,0);
@@ -136,12 +189,12 @@ int main(int argc, char *argv[]) {
 		scene.setLight(Light(Vector(0, size_y/4, size_z/2), intensity));
 
 		// Add walls
-		scene.addSphere(new Sphere(Vector(0,0,1000+3*size_z/4), 1000, Materials::neutral));
-		scene.addSphere(new Sphere(Vector(0,0,-1000-size_z/2), 1000, Materials::green));
-		scene.addSphere(new Sphere(Vector(0,1000+size_y/2, 0), 1000, Materials::red));
-		scene.addSphere(new Sphere(Vector(0,-1000-size_y/2,0), 1000, Materials::blue));
-		scene.addSphere(new Sphere(Vector(1000+size_x/2,0,0), 1000, Materials::magenta));
-		scene.addSphere(new Sphere(Vector(-1000-size_x/2,0,0), 1000, Materials::cyan));
+		scene.addSphere(Sphere(Vector(0,0,1000+3*size_z/4), 1000, scene.addMaterial(Materials::neutral, "neutral")));
+		scene.addSphere(Sphere(Vector(0,0,-1000-size_z/2), 1000, scene.addMaterial(Materials::green, "green")));
+		scene.addSphere(Sphere(Vector(0,1000+size_y/2, 0), 1000, scene.addMaterial(Materials::red, "red")));
+		scene.addSphere(Sphere(Vector(0,-1000-size_y/2,0), 1000, scene.addMaterial(Materials::blue, "blue")));
+		scene.addSphere(Sphere(Vector(1000+size_x/2,0,0), 1000, scene.addMaterial(Materials::magenta, "magenta")));
+		scene.addSphere(Sphere(Vector(-1000-size_x/2,0,0), 1000, scene.addMaterial(Materials::cyan, "cyan")));
 		
 		// Now generate spheres
 		unsigned spheres_created = 0;
@@ -174,11 +227,11 @@ int main(int argc, char *argv[]) {
 			double radius = getUniformNumber() * (r_max - radius_min) + radius_min;
 			double t = getUniformNumber();
 			if (t < mirror_prob)
-				scene.addSphere(new Sphere(origin, radius, Materials::mirror));
+				scene.addSphere(Sphere(origin, radius, scene.addMaterial(Materials::mirror, "mirror")));
 			else if (t < mirror_prob + transparent_prob)
-				scene.addSphere(new Sphere(origin, radius, Materials::glass));
+				scene.addSphere(Sphere(origin, radius, scene.addMaterial(Materials::glass, "glass")));
 			else
-				scene.addSphere(new Sphere(origin, radius, Material(getUniformNumber(), getUniformNumber(), getUniformNumber())));
+				scene.addSphere(Sphere(origin, radius, scene.addMaterial(Material(getUniformNumber(), getUniformNumber(), getUniformNumber()))));
 			++spheres_created;
 			failures = 0;
 		}
@@ -188,105 +241,395 @@ int main(int argc, char *argv[]) {
 		return EXIT_SUCCESS;
 	}
 	
-	/* Loading the scene */
-	std::ifstream scene_spec;
-	scene_spec.open(scene_file);
-	double x, y, z, radius, r, g, b;
-	std::string material;
-	std::string line;
-	unsigned n_line = 0;
-	// We read the file line by line
-	while (getline(scene_spec, line)) {
-		++n_line;
-		if (line[0] == '#') // Skip commentary lines
-			continue;
-		if (line[0] == 'L') { // Handle light specification
-			std::stringstream s(line.substr(1));
-			if (!(s >> x >> y >> z >> intensity)) {
-				ErrorMessage() << "parsing error at line " << n_line << " of file " << scene_file;
-				exit(EXIT_FAILURE);
+	const std::map<std::string, BVH::Quality> qualities = {{"fast", BVH::FAST}, {"balanced", BVH::BALANCED}, {"high", BVH::HIGH}};
+	if (!qualities.count(build_quality)) {
+		ErrorMessage() << "unknown build quality \"" << build_quality << "\"";
+		return EXIT_FAILURE;
+	}
+	if (bvh_width != 2 && bvh_width != 4 && bvh_width != 8) {
+		ErrorMessage() << "the width of the BVH must be 2, 4 or 8";
+		return EXIT_FAILURE;
+	}
+	if (bvh_compress && bvh_width == 2) {
+		ErrorMessage() << "compressed BVH nodes must be wide (width 4 or 8)";
+		return EXIT_FAILURE;
+	}
+	if (sort_rays && !wavefront) {
+		ErrorMessage() << "the rays can only be sorted by the wavefront integrator (--wavefront)";
+		return EXIT_FAILURE;
+	}
+	if (resume && checkpoint_file == "") {
+		ErrorMessage() << "a checkpoint file (--checkpoint) is required to resume a render";
+		return EXIT_FAILURE;
+	}
+	if (checkpoint_file != "" && animation_file != "") {
+		ErrorMessage() << "animations cannot be checkpointed";
+		return EXIT_FAILURE;
+	}
+	BVH::Settings bvh_settings;
+	bvh_settings.quality = qualities.at(build_quality);
+	bvh_settings.width = bvh_width;
+	bvh_settings.compressed = bvh_compress;
+	scene.setBVHSettings(bvh_settings);
+	
+	const std::map<std::string, Scene::Accelerator> accelerators = {{"linear", Scene::LINEAR_ACCEL}, {"grid", Scene::GRID_ACCEL}
+																	, {"bvh", Scene::BVH_ACCEL}, {"dynamic", Scene::DYNAMIC_ACCEL}
+																	, {"auto", Scene::AUTO_ACCEL}};
+	if (!accelerators.count(accel)) {
+		ErrorMessage() << "unknown acceleration structure \"" << accel << "\"";
+		return EXIT_FAILURE;
+	}
+	
+	// The threads are started by the first parallel work (the BVH builds)
+	const std::map<std::string, Scheduler::Affinity> affinities = {{"none", Scheduler::NO_AFFINITY}, {"compact", Scheduler::COMPACT}
+																   , {"scatter", Scheduler::SCATTER}};
+	if (!affinities.count(affinity)) {
+		ErrorMessage() << "unknown affinity \"" << affinity << "\"";
+		return EXIT_FAILURE;
+	}
+	if (n_threads < 0) {
+		ErrorMessage() << "the number of threads must be positive";
+		return EXIT_FAILURE;
+	}
+	Scheduler::setGlobalThreadCount(n_threads);
+	Scheduler::setGlobalAffinity(affinities.at(affinity));
+	
+	/* Hash of the content of the scene file and of the mesh files it uses, part of the keys of the cache and of the
+	   checkpoints */
+	Hash inputs;
+	bool readable = true;
+	if (cache_dir != "" || checkpoint_file != "") {
+		readable = inputs.addFile(scene_file);
+		std::ifstream spec(scene_file);
+		std::string line;
+		while (getline(spec, line)) {
+			std::stringstream s(line);
+			std::string type, mesh_file;
+			double value;
+			if (s >> type && type == "M" && s >> value >> value >> value >> value >> mesh_file) {
+				if (mesh_file[0] != '/')
+					mesh_file = scene_file.substr(0, scene_file.find_last_of('/') + 1) + mesh_file;
+				inputs.add(mesh_file);
+				readable = inputs.addFile(mesh_file) && readable;
 			}
-			light = Vector(x, y, z);
-			scene.setLight(Light(light, intensity));
-			continue;
 		}
-		if (line[0] == 'C') { // Handle camera specification
-			std::stringstream s(line.substr(1));
-			if (!(s >> x >> y >> z)) {
-				ErrorMessage() << "parsing error at line " << n_line << " of file " << scene_file;
+	}
+	
+	/* Loading the scene, from the cache directory if it contains this scene with the same build options */
+	std::string cache_file, cache_key;
+	bool cached = false;
+	bool save_cache = false; // The scene was built and is written to the cache directory
+	auto saveCache = [&]() {
+		if (!scene.saveCache(cache_file, cache_key, camera))
+			WarningMessage() << "could not write cache file " << cache_file;
+	};
+	if (cache_dir != "") {
+		// Key: inputs, build options and precision
+		Hash hash = inputs;
+		std::stringstream options;
+		options << sizeof(real) << " " << accel << " " << build_quality << " " << bvh_width << " " << bvh_compress << " "
+				<< planes_min_radius;
+		hash.add(options.str());
+		cache_key = hash.hex();
+		cache_file = cache_dir + "/" + cache_key + ".cache";
+		cached = readable && scene.loadCache(cache_file, cache_key, camera);
+		if (cached)
+			std::cerr << "Loaded scene from cache file " << cache_file << "\n";
+		else { // Start again from an empty scene
+			scene = Scene();
+			scene.setBVHSettings(bvh_settings);
+		}
+	}
+	if (!cached) {
+		std::ifstream scene_spec;
+		scene_spec.open(scene_file);
+		double x, y, z, radius, r, g, b;
+		std::string material;
+		std::string line;
+		unsigned n_line = 0;
+		Group group; // Group being defined, objects are added to it between G and E lines
+		bool in_group = false;
+		long n_instanced = 0, n_instanced_triangles = 0; // Objects and triangles rendered through instances
+		// Material of an object, given by its name or by "object <r> <g> <b>" in the stream s
+		auto parseMaterial = [&](std::stringstream &s, const std::string &name) {
+			if (name == "object") { // Can specify the color of an object
+				s >> r >> g >> b;
+				return scene.addMaterial(Material(r,g,b));
+			}
+			if (!Materials::by_name.count(name)) {
+				ErrorMessage() << "unknown material \"" << name << "\" at line " << n_line << " of file " << scene_file;
 				exit(EXIT_FAILURE);
 			}
-			camera = Vector(x, y, z);
-			continue;
-		}
-		if (line[0] == 'S') { // Handle sphere specification
-			std::stringstream s(line.substr(1));
-			material = "";
-			s >> x >> y >> z >> radius >> material;
-			if (material == "multicolor") {
-				scene.addSphere(new MultiColorSphere(Vector(x,y,z),radius));
+			return scene.addMaterial(Materials::by_name.at(name), name);
+		};
+		/* The meshes are loaded (file parsed and BVH built) by tasks while the rest of the file is parsed. Those of a
+		   group are waited for at the end of the group, the other ones before the sphere inclusions are computed. */
+		struct MeshLoad {
+			Mesh mesh;
+			std::string path;
+			bool loaded = false;
+		};
+		std::deque<MeshLoad> scene_meshes, group_meshes; // Deques, whose elements are not moved while being loaded
+		std::shared_ptr<Scheduler::Job> loading = Scheduler::global().createJob();
+		// Wait for the loads started so far, and move the loaded meshes to the group (or to the scene if group is null)
+		auto takeMeshes = [&](std::deque<MeshLoad> &loads, Group *group) {
+			Scheduler::global().wait(loading);
+			for (MeshLoad &load : loads) {
+				if (!load.loaded)
+					exit(EXIT_FAILURE);
+				std::cerr << "Loaded mesh " << load.path << " (" << load.mesh.triangles.size() << " triangles)\n";
+				if (group)
+					group->meshes.push_back(std::move(load.mesh));
+				else
+					scene.addMesh(std::move(load.mesh));
 			}
-			else if (material == "object") { // Can specify the color of an object
-				s >> r >> g >> b;
-				scene.addSphere(new Sphere(Vector(x,y,z),radius,Material(r,g,b)));
+			loads.clear();
+		};
+		// We read the file line by line
+		while (getline(scene_spec, line)) {
+			++n_line;
+			if (line[0] == '#') // Skip commentary lines
+				continue;
+			if (line[0] == 'L') { // Handle light specification
+				std::stringstream s(line.substr(1));
+				if (!(s >> x >> y >> z >> intensity)) {
+					ErrorMessage() << "parsing error at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				light = Vector(x, y, z);
+				scene.setLight(Light(light, intensity));
+				continue;
 			}
-			else {
-				scene.addSphere(new Sphere(Vector(x,y,z),radius,Materials::by_name.at(material)));
+			if (line[0] == 'C') { // Handle camera specification
+				std::stringstream s(line.substr(1));
+				if (!(s >> x >> y >> z)) {
+					ErrorMessage() << "parsing error at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				camera = Vector(x, y, z);
+				continue;
 			}
-			continue;
+			if (line[0] == 'S') { // Handle sphere specification
+				std::stringstream s(line.substr(1));
+				Sphere sphere(Vector(0,0,0), 0);
+				material = "";
+				s >> x >> y >> z >> radius >> material;
+				if (material == "multicolor") {
+					sphere = Sphere(Vector(x,y,z),radius,0,Sphere::MULTICOLOR);
+				}
+				else {
+					sphere = Sphere(Vector(x,y,z),radius,parseMaterial(s, material));
+				}
+				if (in_group)
+					group.spheres.push_back(sphere);
+				else
+					scene.addSphere(sphere);
+				continue;
+			}
+			if (line[0] == 'P') { // Handle plane specification
+				if (in_group) {
+					ErrorMessage() << "planes cannot belong to a group, at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				std::stringstream s(line.substr(1));
+				double nx, ny, nz;
+				material = "";
+				if (!(s >> x >> y >> z >> nx >> ny >> nz >> material)) {
+					ErrorMessage() << "parsing error at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				unsigned short m = parseMaterial(s, material);
+				if (material != "object" && Materials::by_name.at(material).refraction > 0) {
+					ErrorMessage() << "planes must be opaque, at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				scene.addPlane(Plane(Vector(x,y,z),Vector(nx,ny,nz),m));
+				continue;
+			}
+			if (line[0] == 'M') { // Handle mesh specification
+				std::stringstream s(line.substr(1));
+				double scale;
+				std::string file;
+				material = "";
+				if (!(s >> x >> y >> z >> scale >> file >> material)) {
+					ErrorMessage() << "parsing error at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				std::deque<MeshLoad> &loads = in_group ? group_meshes : scene_meshes;
+				loads.emplace_back();
+				MeshLoad &load = loads.back();
+				load.mesh.material = parseMaterial(s, material);
+				load.mesh.file = file;
+				// Relative paths are relative to the directory of the scene file
+				if (file[0] != '/')
+					file = scene_file.substr(0, scene_file.find_last_of('/') + 1) + file;
+				load.path = file;
+				Vector position(x,y,z);
+				Scheduler::global().spawn(loading, [&load, position, scale, &bvh_settings]() {
+					load.loaded = load.mesh.load(load.path, position, scale, bvh_settings);
+				});
+				continue;
+			}
+			if (line[0] == 'G') { // Start of a group definition
+				std::stringstream s(line.substr(1));
+				std::string name;
+				if (in_group || !(s >> name) || scene.findGroup(name) >= 0) {
+					ErrorMessage() << "invalid group definition at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				group = Group(name);
+				in_group = true;
+				continue;
+			}
+			if (line[0] == 'E') { // End of a group definition
+				if (in_group)
+					takeMeshes(group_meshes, &group);
+				if (!in_group || (group.spheres.empty() && group.meshes.empty())) {
+					ErrorMessage() << "unexpected end of group or empty group at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				scene.addGroup(std::move(group));
+				in_group = false;
+				continue;
+			}
+			if (line[0] == 'I') { // Handle instance specification
+				std::stringstream s(line.substr(1));
+				std::string name;
+				double scale, rx = 0, ry = 0, rz = 0;
+				if (in_group || !(s >> name >> x >> y >> z >> scale) || scale <= 0) {
+					ErrorMessage() << "parsing error at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				s >> rx >> ry >> rz; // Rotation is optional
+				int g = scene.findGroup(name);
+				if (g < 0) {
+					ErrorMessage() << "unknown group \"" << name << "\" at line " << n_line << " of file " << scene_file;
+					exit(EXIT_FAILURE);
+				}
+				scene.addInstance(Instance(g, Transform(Vector(x,y,z), scale, rx, ry, rz), rx, ry, rz));
+				n_instanced += scene.getGroups()[g].spheres.size() + scene.getGroups()[g].meshes.size();
+				for (const Mesh &mesh : scene.getGroups()[g].meshes)
+					n_instanced_triangles += mesh.triangles.size();
+				continue;
+			}
+		}
+		if (in_group) {
+			ErrorMessage() << "group " << group.name << " is not ended in file " << scene_file;
+			exit(EXIT_FAILURE);
+		}
+		if (!scene.getInstances().empty()) {
+			long n_unique = 0, n_unique_triangles = 0;
+			for (const Group &gr : scene.getGroups()) {
+				n_unique += gr.spheres.size() + gr.meshes.size();
+				for (const Mesh &mesh : gr.meshes)
+					n_unique_triangles += mesh.triangles.size();
+			}
+			std::cerr << scene.getInstances().size() << " instances of " << scene.getGroups().size() << " groups: "
+					  << n_instanced << " objects (" << n_instanced_triangles << " triangles) from " << n_unique
+					  << " unique objects (" << n_unique_triangles << " triangles)\n";
+		}
+		
+		if (planes_min_radius > 0)
+			std::cerr << "Converted " << scene.convertLargeSpheres(planes_min_radius, camera) << " spheres to planes\n";
+		
+		// The meshes loaded meanwhile are needed for the interfaces
+		takeMeshes(scene_meshes, nullptr);
+		
+		// First precompute sphere inclusions and check that transparent spheres are either contained in another or disjoint from another one
+		if (!scene.precomputeSphereInclusion()) {
+			ErrorMessage() << "invalid scene! At least two transparent spheres intersect without one being strictly included into the other.";
+			return EXIT_FAILURE;
 		}
+		
+		// Then build the acceleration structures (the spheres have been sorted)
+		scene.buildAccelerationStructures(accelerators.at(accel));
+		
+		save_cache = (cache_dir != "");
 	}
+	std::cerr << "Acceleration of the spheres: " << scene.acceleratorInfo() << "\n";
+	std::cerr << "Memory of the acceleration structures: " << scene.accelerationMemory() / (1024. * 1024.) << " MB\n";
 	
-	// First precompute sphere inclusions and check that transparent spheres are either contained in another or disjoint from another one
-	if (!scene.precomputeSphereInclusion()) {
-		ErrorMessage() << "invalid scene! At least two transparent spheres intersect without one being strictly included into the other.";
-		return EXIT_FAILURE;
+	/* Animation, whose keyframes are applied to the loaded scene before rendering each frame */
+	Animation animation;
+	if (animation_file != "") {
+		if (save_cache) // Before the scene is edited
+			saveCache();
+		if (!animation.load(animation_file) || !animation.bind(scene))
+			return EXIT_FAILURE;
+		if (n_frames <= 0)
+			n_frames = animation.frameCount();
+		if (output_file == "") {
+			ErrorMessage() << "an output file (or - for the standard output) is required to render an animation";
+			return EXIT_FAILURE;
+		}
+		if (output_file != "-" && !Animation::validFilePattern(output_file)) {
+			ErrorMessage() << "invalid name of the frame files \"" << output_file << "\": it may only contain one integer format (e.g. frame%04d.bmp)";
+			return EXIT_FAILURE;
+		}
 	}
 	
-	/* Rendering for all pixel */
-	std::cerr << "### Treating scene file " << scene_file << " ###";
-	boost::progress_display progress((unsigned long) height+1, std::cerr); // Progress bar
-	++progress;
-    #pragma omp parallel for schedule(dynamic,1)
-	for (int i = 0; i<height; i++) {
-		for (int j = 0; j<width; j++) {
-			Ray ray;
-			// Computing ray for pixel (i,j) with or without antialiasing
-			if (!antialiasing)
-				ray = Ray(camera,Vector(j+0.5-width/2, i+0.5-height/2,-height/(2*tan(fov/2))).normalize()); 
-			// Simulate with n_retry rays and do the mean
-			Vector color = Vector(0, 0, 0);
-			for (int n = 0; n<n_retry; n++) {
-				if (antialiasing) {
-						double x = getUniformNumber(); 
-						double y = getUniformNumber();
-						double R = sqrt(-2*log(x));
-						double u = R * cos(2 * PI * y) * 0.5;
-						double v = R * sin(2 * PI * y) * 0.5;
-						ray = Ray(camera, Vector(j+u-width/2-0.5, i+v-height/2-0.5,-height/(2*tan(fov/2))).normalize());		
-				}
-				color = color + scene.getColor(ray, n_bounces, fresnel, diffuse, deterministic);
+	const int tile_size = wavefront ? WAVEFRONT_TILE_SIZE : TILE_SIZE;
+	
+	/* Samples taken so far of each pixel, loaded from the checkpoint file to resume a render. The key of the file
+	   does not depend on the number of samples, which may be increased when resuming. */
+	Checkpoint state;
+	state.reset(width, height);
+	std::string checkpoint_key;
+	if (checkpoint_file != "") {
+		// Key: inputs and every option which changes the samples, down to their rounding (the integrator, the tracing
+		// of the rays by packets or from the rasterized spheres, the acceleration structures)
+		Hash hash = inputs;
+		std::stringstream options;
+		options << sizeof(real) << " " << width << " " << height << " " << fov << " " << n_bounces << " " << fresnel << " "
+				<< antialiasing << " " << diffuse << " " << deterministic << " " << prune_weight << " " << max_rays << " "
+				<< planes_min_radius << " " << tile_size << " " << wavefront << " " << sort_rays << " " << packets << " "
+				<< rasterize << " " << accel << " " << build_quality << " " << bvh_width << " " << bvh_compress;
+		hash.add(options.str());
+		checkpoint_key = hash.hex();
+		if (resume) {
+			if (!readable || !state.load(checkpoint_file, checkpoint_key, width, height)) {
+				ErrorMessage() << "cannot resume from checkpoint file " << checkpoint_file << ": missing, or written for another scene or other options";
+				return EXIT_FAILURE;
 			}
-			color = (1. / ((double)n_retry)) * color;
-			
-			// Write the result in the image, applying gamma correction and ensuring that the output color is between 0 and 255
-			img[((height-i-1)*width+j)] = std::min(255, (int) (255. * pow(color.x,1./gamma)));
-			img[((height-i-1)*width+j) + height*width] = std::min(255, (int) (255. * pow(color.y,1./gamma)));
-			img[((height-i-1)*width+j) + 2*height*width] = std::min(255, (int) (255. * pow(color.z,1./gamma)));
+			std::cerr << "Resuming from checkpoint file " << checkpoint_file << " (" << state.meanSamples() << " samples per pixel)\n";
 		}
-		++progress;
+		Renderer::catchSignals();
 	}
 	
-	// Output in a file or display generated image
-	cimg_library::CImg<unsigned char> cimg(&img[0], width, height, 1, 3);
-	if (output_file != "") {
-		cimg.save(output_file.c_str());
-		std::cerr << "Wrote output in file " << output_file << "\n";
-	}
-	else
-		cimg.display();
+	/* Rendering of the scene seen from the camera, by tiles run by the scheduler */
+	Scheduler &scheduler = Scheduler::global();
+	std::cerr << "Rendering with " << scheduler.info() << "\n";
+	Renderer::Settings settings;
+	settings.scene_file = scene_file;
+	settings.animation_file = animation_file;
+	settings.width = width;
+	settings.height = height;
+	settings.fov = fov;
+	settings.samples = n_retry;
+	settings.bounces = n_bounces;
+	settings.fresnel = fresnel;
+	settings.antialiasing = antialiasing;
+	settings.diffuse = diffuse;
+	settings.deterministic = deterministic;
+	settings.prune_weight = prune_weight;
+	settings.max_rays = max_rays;
+	settings.wavefront = wavefront;
+	settings.sort_rays = sort_rays;
+	settings.packets = packets;
+	settings.rasterize = rasterize;
+	settings.checkpoint_file = checkpoint_file;
+	settings.checkpoint_key = checkpoint_key;
+	settings.checkpoint_interval = checkpoint_interval;
+	Renderer renderer(scene, settings);
+	
+	if (animation_file != "")
+		return renderer.renderAnimation(animation, n_frames, camera, output_file);
 	
-	// Free memory and return
-	free(img);
-	return 0;
+	// The cache file is written while the image is rendered, both only read the scene
+	std::shared_ptr<Scheduler::Job> caching = scheduler.createJob();
+	if (save_cache)
+		scheduler.spawn(caching, saveCache);
+	int status = renderer.renderImage(camera, state, output_file);
+	scheduler.wait(caching);
+	return status;
 }
@@ -0,0 +1,365 @@
+#include "renderer.hpp"
+#include "raster.hpp"
+#include "scheduler.hpp"
+#include "utils.hpp"
+#include <math.h>
+#include <algorithm>
+#include <mutex>
+#include <chrono>
+#include <cstdio>
+#include <csignal>
+#include <boost/progress.hpp>
+
+#include "CImg.h"
+
+static_assert(TILE_SIZE <= Scene::PACKET_SIZE, "the camera rays of a row of a tile are traced as a packet");
+// With checkpoints, number of samples of each pixel taken by a pass over the whole image
+constexpr int CHECKPOINT_PASS_SAMPLES = 16;
+constexpr double GAMMA = 2.2; // Gamma correction coefficient
+
+// Set by SIGINT and SIGTERM during a render with checkpoints, which then stops and saves its samples. It is read by
+// the workers: a volatile sig_atomic_t is only safe within the thread running the handler, a lock-free atomic in all.
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "the signal handler needs a lock-free atomic");
+static std::atomic<int> interrupted(0); // Number of the signal
+static void interrupt(int signal) {
+	interrupted.store(signal, std::memory_order_relaxed);
+	std::signal(signal, SIG_DFL); // A second signal terminates the program
+}
+
+void Renderer::catchSignals() {
+	std::signal(SIGINT, interrupt);
+	std::signal(SIGTERM, interrupt);
+}
+
+Renderer::Renderer(Scene &s, const Settings &set)
+	: scene(s), settings(set), tile_size(set.wavefront ? WAVEFRONT_TILE_SIZE : TILE_SIZE)
+	, tiles_x((set.width + tile_size - 1) / tile_size), tiles_y((set.height + tile_size - 1) / tile_size)
+	, traced(0), pruned_weight(0), pruned_cap(0), integrators(Scheduler::global().threadCount()) {}
+
+void Renderer::setPixel(int *img, int i, int j, const Vector &color) const {
+	const int width = settings.width, height = settings.height;
+	img[((height-i-1)*width+j)] = std::min(255, (int) (255. * pow(color.x,1./GAMMA)));
+	img[((height-i-1)*width+j) + height*width] = std::min(255, (int) (255. * pow(color.y,1./GAMMA)));
+	img[((height-i-1)*width+j) + 2*height*width] = std::min(255, (int) (255. * pow(color.z,1./GAMMA)));
+}
+
+void Renderer::saveImage(const int *img, const std::string &path) const {
+	cimg_library::CImg<unsigned char> cimg(img, settings.width, settings.height, 1, 3);
+	if (path != "")
+		cimg.save(path.c_str());
+	else
+		cimg.display();
+}
+
+void Renderer::printPruning() const {
+	if (settings.deterministic)
+		std::cerr << "Ray tree pruning: " << traced << " secondary rays traced, " << pruned_weight << " branches dropped by weight, "
+				  << pruned_cap << " dropped by the ray cap\n";
+}
+
+bool Renderer::render(const Vector &camera, int *img, Checkpoint &state, ImageWriter *writer, bool show_progress) {
+	Scheduler &scheduler = Scheduler::global();
+	const int width = settings.width, height = settings.height;
+	const double fov = settings.fov;
+	const bool antialiasing = settings.antialiasing;
+	
+	/* If the color of a camera ray does not depend on the sample, a single sample per pixel is enough */
+	int n_samples = settings.samples;
+	if (!antialiasing && settings.samples > 1 && scene.isDeterministic(settings.fresnel, settings.diffuse, settings.deterministic)) {
+		if (show_progress)
+			std::cerr << "Rendering is deterministic with these options: using 1 ray per pixel instead of " << settings.samples << "\n";
+		n_samples = 1;
+	}
+	
+	/* With threads pinned on several NUMA nodes, the tiles of each node are rendered from a copy of the scene
+	   (with its acceleration structures) made by the first of its workers which needs it, so that the copy is
+	   allocated on the node. It is made for each frame since animations edit the scene. */
+	const int n_nodes = scheduler.nodeCount();
+	std::vector<std::unique_ptr<Scene> > replicas(n_nodes);
+	std::unique_ptr<std::once_flag[]> replicated(new std::once_flag[n_nodes]);
+	auto localScene = [&]() -> const Scene& {
+		if (n_nodes == 1)
+			return scene;
+		int node = scheduler.workerNode(scheduler.currentWorker());
+		std::call_once(replicated[node], [&]() {replicas[node].reset(new Scene(scene));});
+		return *replicas[node];
+	};
+	
+	/* Hybrid rendering: the closest spheres of the camera rays are found by rasterization, the spheres being
+	   binned by the tiles of the screen that their projections overlap */
+	SphereRaster raster;
+	if (settings.rasterize) {
+		scene.rasterizeSpheres(raster, camera, height/(2*tan(fov/2)), width, height, TILE_SIZE);
+		if (show_progress)
+			std::cerr << "Rasterized spheres: " << raster.info() << "\n";
+	}
+	
+	auto centerRay = [&](int i, int j) { // Camera ray going through the center of pixel (i,j)
+		return Ray(camera,Vector(j+0.5-width/2, i+0.5-height/2,-height/(2*tan(fov/2))).normalize());
+	};
+	auto jitteredRay = [&](int i, int j) { // Camera ray going through a random point of pixel (i,j), for antialiasing
+		double x = getUniformNumber();
+		double y = getUniformNumber();
+		double R = sqrt(-2*log(x));
+		double u = R * cos(2 * PI * y) * 0.5;
+		double v = R * sin(2 * PI * y) * 0.5;
+		return Ray(camera, Vector(j+u-width/2-0.5, i+v-height/2-0.5,-height/(2*tan(fov/2))).normalize());
+	};
+	
+	/* Rendering for all pixel. All the pixels of a tile have the same number of samples. */
+	const int pass_samples = settings.checkpoint_file != "" ? CHECKPOINT_PASS_SAMPLES : n_samples;
+	const int min_count = *std::min_element(state.counts.begin(), state.counts.end());
+	const int n_passes = std::max(1, (n_samples - min_count + pass_samples - 1) / pass_samples);
+	std::unique_ptr<boost::progress_display> progress; // Progress bar, by tiles
+	std::mutex progress_mutex;
+	if (show_progress) {
+		std::cerr << "### Treating scene file " << settings.scene_file << " ###";
+		progress.reset(new boost::progress_display((unsigned long) tiles_x * tiles_y * n_passes + 1, std::cerr));
+		++*progress;
+	}
+	/* Streaming of the image: the bands of tiles are rendered in the order of the file, and each band is written
+	   by a high priority task once all its tiles are done, while the next ones are rendered. The bands are
+	   numbered in the order of the file. */
+	std::shared_ptr<Scheduler::Job> encoding = scheduler.createJob(Scheduler::HIGH);
+	std::unique_ptr<std::atomic<int>[]> band_tiles(new std::atomic<int>[tiles_y]); // Tiles left in each band
+	std::vector<bool> band_done(tiles_y, false);
+	int next_band = 0; // First band not written yet
+	std::mutex writer_mutex; // Protects the writer, band_done and next_band
+	for (int band = 0; band < tiles_y; band++)
+		band_tiles[band] = tiles_x;
+	const bool top_down = writer && !writer->bottomUp();
+	auto bandRows = [&](int band) { // Row i of pixels at the bottom of a band of the file, and its number of rows
+		int i_begin = (top_down ? tiles_y - 1 - band : band) * tile_size;
+		return std::make_pair(i_begin, std::min(i_begin + tile_size, height) - i_begin);
+	};
+	auto writeBand = [&](int band) {
+		std::lock_guard<std::mutex> lock(writer_mutex);
+		band_done[band] = true;
+		for (; next_band < tiles_y && band_done[next_band]; next_band++)
+			writer->write(img, bandRows(next_band).second);
+	};
+	
+	const Wavefront::Settings wavefront_settings = {settings.bounces, settings.fresnel, settings.diffuse, settings.deterministic
+													, (real) settings.prune_weight, settings.max_rays, settings.sort_rays
+													, settings.packets};
+	auto renderTile = [&](unsigned tile, ImageWriter *writer) {
+		const Scene &scene = localScene();
+		const int band = tile / tiles_x;
+		int i_begin = bandRows(band).first, j_begin = (tile % tiles_x) * tile_size;
+		int i_end = std::min(i_begin + tile_size, height), j_end = std::min(j_begin + tile_size, width);
+		int tile_width = j_end - j_begin;
+		const int n_tile_samples = std::min(pass_samples, n_samples - state.counts[i_begin * width + j_begin]);
+		// The sums of the colors of the samples of the tile are computed in a buffer allocated by the worker (on
+		// its node), and added to state at the end
+		std::vector<Vector> colors((i_end - i_begin) * tile_width);
+		long tile_traced = 0, tile_pruned_weight = 0, tile_pruned_cap = 0;
+		if (n_tile_samples <= 0) {
+			// All the samples of the tile were taken before resuming
+		}
+		else if (settings.wavefront) {
+			std::unique_ptr<Wavefront> &integrator = integrators[scheduler.currentWorker()];
+			if (!integrator)
+				integrator.reset(new Wavefront(wavefront_settings));
+			// Camera rays of all the samples, or of the pixels if they do not depend on the sample
+			std::vector<Ray> rays;
+			rays.reserve(colors.size() * (antialiasing ? n_tile_samples : 1));
+			for (int i = i_begin; i < i_end; i++)
+				for (int j = j_begin; j < j_end; j++) {
+					if (!antialiasing)
+						rays.push_back(centerRay(i, j));
+					else
+						for (int n = 0; n < n_tile_samples; n++)
+							rays.push_back(jitteredRay(i, j));
+				}
+			Wavefront::Stats stats;
+			integrator->render(scene, rays, n_tile_samples, !antialiasing, colors.data(), stats, settings.rasterize ? &raster : nullptr);
+			tile_traced = stats.traced;
+			tile_pruned_weight = stats.pruned_weight;
+			tile_pruned_cap = stats.pruned_cap;
+		}
+		else
+			for (int i = i_begin; i < i_end; i++) {
+				/* The camera rays of the pixels of a row of the tile are traced together, as a packet, for each
+				   sample. First hit cache: when the camera ray of a pixel is the same for all its samples (no
+				   antialiasing), its closest intersection is computed once and all the samples start from it. */
+				Ray rays[TILE_SIZE];
+				Scene::Intersection first_hits[TILE_SIZE];
+				Vector row_colors[TILE_SIZE];
+				// In deterministic mode, the ray tree of each camera ray is pruned
+				std::vector<Scene::RayBudget> budgets(tile_width, Scene::RayBudget(settings.prune_weight, settings.max_rays));
+				// Simulate with n_tile_samples rays and sum their colors
+				for (int n = 0; n<n_tile_samples; n++) {
+					if (n == 0 || antialiasing) {
+						for (int j = j_begin; j < j_end; j++)
+							rays[j - j_begin] = antialiasing ? jitteredRay(i, j) : centerRay(i, j);
+						if (settings.rasterize)
+							for (int p = 0; p < tile_width; p++)
+								first_hits[p] = scene.intersect(rays[p], raster);
+						else if (settings.packets)
+							scene.intersectPacket(rays, tile_width, first_hits);
+						else
+							for (int p = 0; p < tile_width; p++)
+								first_hits[p] = scene.intersect(rays[p]);
+					}
+					for (int p = 0; p < tile_width; p++) {
+						budgets[p].rays = 0;
+						row_colors[p] = row_colors[p] + scene.getColor(rays[p], first_hits[p], settings.bounces, settings.fresnel
+																	   , settings.diffuse, settings.deterministic
+																	   , settings.deterministic ? &budgets[p] : nullptr);
+						tile_traced += budgets[p].rays;
+					}
+				}
+				for (int p = 0; p < tile_width; p++) {
+					colors[(i - i_begin) * tile_width + p] = row_colors[p];
+					tile_pruned_weight += budgets[p].pruned_weight;
+					tile_pruned_cap += budgets[p].pruned_cap;
+				}
+			}
+		
+		// Add the samples to state and write the mean colors in the image
+		for (int i = i_begin; i < i_end; i++)
+			for (int j = j_begin; j < j_end; j++) {
+				int p = i * width + j;
+				if (n_tile_samples > 0) {
+					state.sums[p] = state.sums[p] + colors[(i - i_begin) * tile_width + j - j_begin];
+					state.counts[p] += n_tile_samples;
+				}
+				setPixel(img, i, j, state.color(p));
+			}
+		if (writer && --band_tiles[band] == 0)
+			scheduler.spawn(encoding, [&, band]() {writeBand(band);});
+		traced += tile_traced;
+		pruned_weight += tile_pruned_weight;
+		pruned_cap += tile_pruned_cap;
+		if (show_progress) {
+			std::lock_guard<std::mutex> lock(progress_mutex);
+			++*progress;
+		}
+	};
+	
+	auto last_checkpoint = std::chrono::steady_clock::now();
+	for (int pass = 0; pass < n_passes; pass++) {
+		ImageWriter *pass_writer = (pass == n_passes - 1) ? writer : nullptr;
+		// On a signal, the tiles which have not started are cancelled
+		std::shared_ptr<Scheduler::Job> job = scheduler.createJob();
+		bool finished = scheduler.parallelFor(job, 0, tiles_x * tiles_y, 1, [&](unsigned tile, unsigned) {
+			if (interrupted.load(std::memory_order_relaxed))
+				job->cancel();
+			else
+				renderTile(tile, pass_writer);
+		});
+		scheduler.wait(encoding);
+		if (!finished)
+			return false;
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - last_checkpoint;
+		if (settings.checkpoint_file != "" && pass < n_passes - 1 && elapsed.count() >= settings.checkpoint_interval) {
+			if (!state.save(settings.checkpoint_file, settings.checkpoint_key))
+				WarningMessage() << "could not write checkpoint file " << settings.checkpoint_file;
+			last_checkpoint = std::chrono::steady_clock::now();
+		}
+	}
+	return true;
+}
+
+int Renderer::renderImage(const Vector &camera, Checkpoint &state, const std::string &output_file) {
+	const int width = settings.width, height = settings.height;
+	const std::string &checkpoint_file = settings.checkpoint_file;
+	std::vector<int> img(3 * height * width);
+	// BMP and PPM files are written while the image is rendered, other formats are saved at the end
+	ImageWriter writer;
+	if (ImageWriter::format(output_file) != ImageWriter::NONE && !writer.open(output_file, width, height)) {
+		ErrorMessage() << "could not create output file " << output_file;
+		return EXIT_FAILURE;
+	}
+	const bool streamed = writer.isOpen();
+	
+	if (!render(camera, img.data(), state, streamed ? &writer : nullptr, true)) {
+		// Interrupted: the samples are saved to resume the render, and the image of those taken so far is written
+		// next to the checkpoint file. The output file, whose bands were not all written, is removed.
+		if (streamed) {
+			writer.close();
+			std::remove(output_file.c_str());
+		}
+		std::cerr << "\nInterrupted with " << state.meanSamples() << " samples per pixel\n";
+		if (!state.save(checkpoint_file, settings.checkpoint_key)) {
+			ErrorMessage() << "could not write checkpoint file " << checkpoint_file;
+			return EXIT_FAILURE;
+		}
+		std::cerr << "Wrote checkpoint file " << checkpoint_file << ", to be resumed with --resume\n";
+		for (int i = 0; i < height; i++)
+			for (int j = 0; j < width; j++)
+				setPixel(img.data(), i, j, state.color(i * width + j));
+		std::string preview = checkpoint_file + ".bmp";
+		saveImage(img.data(), preview);
+		std::cerr << "Wrote preview in file " << preview << "\n";
+		return 128 + interrupted.load();
+	}
+	
+	printPruning();
+	
+	// Output in a file or display generated image
+	if (!streamed)
+		saveImage(img.data(), output_file);
+	else if (!writer.close()) {
+		ErrorMessage() << "could not write output file " << output_file;
+		return EXIT_FAILURE;
+	}
+	if (output_file != "")
+		std::cerr << "Wrote output in file " << output_file << "\n";
+	// A complete render has nothing left to resume, nor to preview
+	if (checkpoint_file != "") {
+		std::remove(checkpoint_file.c_str());
+		std::remove((checkpoint_file + ".bmp").c_str());
+	}
+	return 0;
+}
+
+int Renderer::renderAnimation(const Animation &animation, int n_frames, Vector &camera, const std::string &output_file) {
+	/* Sequence mode: the frames are rendered one after the other in the same scene, edited by the animation.
+	   Each frame is encoded and written by a high priority task while the tiles of the next one are rendered,
+	   so two buffers are used. */
+	Scheduler &scheduler = Scheduler::global();
+	const int width = settings.width, height = settings.height;
+	const bool raw_video = (output_file == "-");
+	std::vector<int> frames[2] = {std::vector<int>(3 * height * width), std::vector<int>(3 * height * width)};
+	std::shared_ptr<Scheduler::Job> encoding; // Encoding of the previous frame, run first by the next free worker
+	auto encode = [&](const int *frame, int k) {
+		if (raw_video) { // Interleaved 8 bit RGB, rows from top to bottom
+			std::vector<unsigned char> rgb(3 * height * width);
+			for (int p = 0; p < height * width; p++)
+				for (int c = 0; c < 3; c++)
+					rgb[3*p + c] = frame[p + c*height*width];
+			fwrite(rgb.data(), 1, rgb.size(), stdout);
+			fflush(stdout);
+		}
+		else
+			saveImage(frame, Animation::frameFileName(output_file, k));
+	};
+	Checkpoint state;
+	std::cerr << "### Rendering " << n_frames << " frames of animation " << settings.animation_file << " ###";
+	boost::progress_display progress((unsigned long) n_frames, std::cerr);
+	for (int k = 0; k < n_frames; k++) {
+		if (!animation.apply(k, scene, camera)) {
+			ErrorMessage() << "invalid scene at frame " << k << "! At least two transparent spheres intersect without one being strictly included into the other.";
+			return EXIT_FAILURE;
+		}
+		int *frame = frames[k % 2].data();
+		state.reset(width, height);
+		render(camera, frame, state, nullptr, false);
+		if (encoding)
+			scheduler.wait(encoding);
+		encoding = scheduler.createJob(Scheduler::HIGH);
+		scheduler.spawn(encoding, [=, &encode]() {encode(frame, k);});
+		++progress;
+	}
+	if (encoding)
+		scheduler.wait(encoding);
+	
+	std::cerr << "Acceleration of the spheres at the last frame: " << scene.acceleratorInfo() << "\n";
+	printPruning();
+	if (raw_video)
+		std::cerr << "Wrote " << n_frames << " frames of " << width << "x" << height << " raw RGB video on the standard output\n";
+	else
+		std::cerr << "Wrote " << n_frames << " frames in files " << Animation::frameFileName(output_file, 0) << "...\n";
+	return 0;
+}
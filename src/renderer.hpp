@@ -0,0 +1,81 @@
+#ifndef RENDERER_HPP
+#define RENDERER_HPP
+
+#include "scene.hpp"
+#include "wavefront.hpp"
+#include "checkpoint.hpp"
+#include "image_writer.hpp"
+#include "animation.hpp"
+#include "vector.hpp"
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Size in pixels of the square tiles rendered by the tasks of the scheduler. The wavefront integrator traces all the
+// rays of a tile together, so its tiles are larger.
+constexpr int TILE_SIZE = 16;
+constexpr int WAVEFRONT_TILE_SIZE = 64;
+
+/** Rendering of the images of a scene by tiles run by the global scheduler
+	The samples of the pixels are added to a Checkpoint. With a checkpoint file, they are taken by passes over the
+	whole image, the checkpoint being saved between passes, and a render stopped by a signal saves it and a preview.
+	A single image is written to its file (by bands of tiles while it is rendered for BMP and PPM files) or
+	displayed. The frames of an animation are rendered one after the other, each one being written while the next
+	one is rendered.
+*/
+class Renderer {
+public:
+	// Options of the render
+	struct Settings {
+		std::string scene_file, animation_file; // Named above the progress bars
+		int width, height;
+		double fov; // In radians
+		int samples; // Rays per pixel
+		int bounces;
+		bool fresnel, antialiasing, diffuse, deterministic;
+		double prune_weight; // Ray budget in deterministic mode
+		long max_rays;
+		bool wavefront; // Trace the rays of each tile with the wavefront integrator
+		bool sort_rays; // Reorder the secondary rays of the wavefront integrator for coherence
+		bool packets; // Trace the camera rays and the shadow rays by packets
+		bool rasterize; // Find the closest spheres of the camera rays by rasterization
+		std::string checkpoint_file; // Empty without checkpoints
+		std::string checkpoint_key;
+		double checkpoint_interval; // Minimum time in seconds between two checkpoints
+	};
+	
+	Renderer(Scene &scene, const Settings &settings);
+	
+	// From now on, SIGINT and SIGTERM stop the render, which saves its checkpoint (a second signal terminates the program)
+	static void catchSignals();
+	
+	// Render the image seen from camera, adding its samples to those of state, and write it to output_file (display it
+	// if empty). Returns the exit status of the program, 128 + the number of the signal if the render was interrupted.
+	int renderImage(const Vector &camera, Checkpoint &state, const std::string &output_file);
+	// Render the first n_frames frames of animation, applied to the scene, to the files named after the pattern
+	// output_file, or to the standard output as raw RGB video with "-". Returns the exit status of the program.
+	int renderAnimation(const Animation &animation, int n_frames, Vector &camera, const std::string &output_file);
+	
+private:
+	// Add the samples of the pixels to those of state and write their mean colors to img. If writer is given, the
+	// bands of tiles of the last pass are written to it as soon as they are rendered. Returns false if the render
+	// was interrupted by a signal: state then holds the samples of the tiles which were finished.
+	bool render(const Vector &camera, int *img, Checkpoint &state, ImageWriter *writer, bool show_progress);
+	
+	// Write the color of pixel (i,j) in the image, applying gamma correction and ensuring that the output color is
+	// between 0 and 255
+	void setPixel(int *img, int i, int j, const Vector &color) const;
+	// Save the whole image with CImg, or display it if path is empty
+	void saveImage(const int *img, const std::string &path) const;
+	void printPruning() const; // Statistics of ray tree pruning in deterministic mode
+	
+	Scene &scene;
+	const Settings settings;
+	const int tile_size, tiles_x, tiles_y;
+	std::atomic<long> traced, pruned_weight, pruned_cap; // Statistics of ray tree pruning, over all the renders
+	// Wavefront integrator of each worker, which keeps its queues from one tile to the next
+	std::vector<std::unique_ptr<Wavefront> > integrators;
+};
+
+#endif
@@ -1,54 +1,502 @@
 #include "utils.hpp"
 #include "scene.hpp"
 #include <algorithm>
+#include <limits>
 #include <math.h>
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+
+// Interface of opaque objects (planes), which is never used for refraction
+static const Scene::Interface opaque_interface = {1, 1, 0, true};
+
+// Interface of an object of refractive index n_in with the void
+static Scene::Interface voidInterface(real n_in) {
+	Scene::Interface interface;
+	interface.eta_enter = 1 / n_in;
+	interface.eta_exit = n_in;
+	interface.k0 = (1-n_in)*(1-n_in)/((1+n_in)*(1+n_in));
+	interface.matched = false; // As a sphere outside any other, it always goes through Fresnel reflection
+	return interface;
+}
+
+// Bounding box of a sphere
+static BBox sphereBox(const Sphere &sphere) {
+	Vector r(sphere.radius, sphere.radius, sphere.radius);
+	return BBox(sphere.origin - r, sphere.origin + r);
+}
+
+int Scene::addGroup(Group &&g) {
+	for (Mesh &mesh : g.meshes)
+		mesh.solid = (materials[mesh.material].refraction > 0);
+	g.build(bvh_settings);
+	group_by_name[g.name] = groups.size();
+	groups.push_back(std::move(g));
+	return groups.size() - 1;
+}
+
+int Scene::findGroup(const std::string &name) const {
+	auto it = group_by_name.find(name);
+	return (it == group_by_name.end()) ? -1 : it->second;
+}
+
+// Below this number of spheres, testing all of them is the fastest
+constexpr unsigned MIN_ACCEL_SPHERES = 16;
+// Spheres whose radius is more than this factor times the median radius are not put in the grid
+constexpr real LARGE_SPHERE_FACTOR = 8;
+// The automatic choice is the grid if at most this fraction of its cells is empty (the spheres fill their
+// bounds uniformly), the BVH otherwise
+constexpr real MAX_EMPTY_GRID = 0.75;
+
+Scene::Accelerator Scene::buildAccelerationStructures(Accelerator accel) {
+	if (accel == AUTO_ACCEL && spheres.size() < MIN_ACCEL_SPHERES)
+		accel = LINEAR_ACCEL;
+	// Without spheres (scenes of planes, meshes or instances), there is no median radius nor anything to put in the grid
+	if (accel == GRID_ACCEL && spheres.empty())
+		accel = LINEAR_ACCEL;
+	
+	sphere_grid = Grid();
+	sphere_bvh = BVH();
+	sphere_dynamic = DynamicBVH();
+	large_spheres.clear();
+	if (accel == GRID_ACCEL || accel == AUTO_ACCEL) {
+		// The walls of the scenes are huge spheres, which would be in most of the cells
+		std::vector<real> radii;
+		for (const Sphere &sphere : spheres)
+			radii.push_back(sphere.radius);
+		std::nth_element(radii.begin(), radii.begin() + radii.size() / 2, radii.end());
+		real max_radius = LARGE_SPHERE_FACTOR * radii[radii.size() / 2];
+		std::vector<int> grid_spheres;
+		std::vector<BBox> boxes;
+		for (int i = 0; i < (long) spheres.size(); i++) {
+			if (spheres[i].radius > max_radius) {
+				large_spheres.push_back(i);
+				continue;
+			}
+			Vector r(spheres[i].radius, spheres[i].radius, spheres[i].radius);
+			grid_spheres.push_back(i);
+			boxes.push_back(BBox(spheres[i].origin - r, spheres[i].origin + r));
+		}
+		sphere_grid.build(boxes);
+		for (unsigned &index : sphere_grid.indices)
+			index = grid_spheres[index];
+		if (accel == AUTO_ACCEL)
+			accel = (sphere_grid.emptyCellCount() <= MAX_EMPTY_GRID * sphere_grid.cellCount()) ? GRID_ACCEL : BVH_ACCEL;
+		if (accel != GRID_ACCEL) {
+			sphere_grid = Grid();
+			large_spheres.clear();
+		}
+	}
+	if (accel == BVH_ACCEL) {
+		std::vector<BBox> boxes;
+		for (const Sphere &sphere : spheres) {
+			Vector r(sphere.radius, sphere.radius, sphere.radius);
+			boxes.push_back(BBox(sphere.origin - r, sphere.origin + r));
+		}
+		sphere_bvh.build(boxes, 2, bvh_settings);
+	}
+	if (accel == DYNAMIC_ACCEL) {
+		std::vector<BBox> boxes;
+		for (const Sphere &sphere : spheres)
+			boxes.push_back(sphereBox(sphere));
+		sphere_dynamic.build(boxes, bvh_settings.quality);
+	}
+	sphere_accel = accel;
+	
+	// Top level of the two-level structure: BVH over the bounding boxes of the instances
+	std::vector<BBox> boxes;
+	for (const Instance &instance : instances)
+		boxes.push_back(instance.transform.box(groups[instance.group].bounds()));
+	instance_bvh.build(boxes, 1, bvh_settings);
+	return sphere_accel;
+}
+
+void Scene::makeDynamic() {
+	if (sphere_accel == DYNAMIC_ACCEL)
+		return;
+	std::vector<BBox> boxes;
+	for (const Sphere &sphere : spheres)
+		boxes.push_back(sphereBox(sphere));
+	sphere_dynamic.build(boxes, bvh_settings.quality);
+	sphere_grid = Grid();
+	sphere_bvh = BVH();
+	large_spheres.clear();
+	sphere_accel = DYNAMIC_ACCEL;
+}
+
+void Scene::moveSphere(int i, const Vector &origin, real radius) {
+	makeDynamic();
+	spheres[i].origin = origin;
+	spheres[i].radius = radius;
+	sphere_dynamic.update(i, sphereBox(spheres[i]));
+}
+
+int Scene::insertSphere(const Sphere &s) {
+	makeDynamic();
+	spheres.push_back(s);
+	sphere_keys.push_back(next_sphere_key++);
+	sphere_dynamic.insert(spheres.size() - 1, sphereBox(s));
+	return spheres.size() - 1;
+}
+
+void Scene::removeSphere(int i) {
+	makeDynamic();
+	sphere_dynamic.remove(i);
+	int last = spheres.size() - 1;
+	if (i != last) {
+		spheres[i] = spheres[last];
+		sphere_keys[i] = sphere_keys[last];
+		sphere_dynamic.rename(last, i);
+	}
+	spheres.pop_back();
+	sphere_keys.pop_back();
+}
+
+bool Scene::commitEdits() {
+	if (sphere_accel == DYNAMIC_ACCEL) {
+		sphere_dynamic.refit();
+		if (sphere_dynamic.degraded()) {
+			std::vector<BBox> boxes;
+			for (const Sphere &sphere : spheres)
+				boxes.push_back(sphereBox(sphere));
+			sphere_dynamic.build(boxes, bvh_settings.quality);
+			++dynamic_rebuilds;
+		}
+	}
+	// The spheres are not sorted again, which would change their indices
+	return computeSphereInclusion();
+}
+
+size_t Scene::accelerationMemory() const {
+	size_t size = sphere_bvh.memory() + sphere_dynamic.memory() + instance_bvh.memory()
+		+ (sphere_grid.cells.size() + sphere_grid.indices.size() + large_spheres.size()) * sizeof(unsigned);
+	for (const Mesh &mesh : meshes)
+		size += mesh.bvh.memory();
+	for (const Group &group : groups) {
+		size += group.bvh.memory();
+		for (const Mesh &mesh : group.meshes)
+			size += mesh.bvh.memory();
+	}
+	return size;
+}
+
+// Identification of cache files, to be changed when their format changes
+static const std::string CACHE_MAGIC = "raytracer scene cache 3";
+
+bool Scene::saveCache(const std::string &path, const std::string &key, const Vector &camera) const {
+	CacheWriter w(path);
+	w.write(CACHE_MAGIC);
+	w.write((int) sizeof(real));
+	w.write(key);
+	w.write(camera);
+	w.write(light);
+	w.write(materials);
+	w.write((unsigned long long) material_names.size());
+	for (const std::string &name : material_names)
+		w.write(name);
+	w.write(spheres);
+	w.write(sphere_keys);
+	w.write(next_sphere_key);
+	w.write(planes);
+	w.write((unsigned long long) meshes.size());
+	for (const Mesh &mesh : meshes)
+		mesh.save(w);
+	w.write((unsigned long long) groups.size());
+	for (const Group &group : groups)
+		group.save(w);
+	w.write(instances);
+	w.write(sphere_inclusion);
+	w.write(interfaces);
+	w.write(mesh_interfaces);
+	for (const std::vector<Interface> &group_interface : group_interfaces)
+		w.write(group_interface);
+	instance_bvh.save(w);
+	w.write(sphere_accel);
+	sphere_grid.save(w);
+	sphere_bvh.save(w);
+	sphere_dynamic.save(w);
+	w.write(large_spheres);
+	return w.commit();
+}
+
+bool Scene::loadCache(const std::string &path, const std::string &key, Vector &camera) {
+	CacheReader r(path);
+	std::string magic, cached_key;
+	int real_size;
+	unsigned long long n;
+	if (!r.good() || !r.read(magic) || magic != CACHE_MAGIC || !r.read(real_size) || real_size != sizeof(real)
+		|| !r.read(cached_key) || cached_key != key)
+		return false;
+	if (!r.read(camera) || !r.read(light) || !r.read(materials) || !r.read(n))
+		return false;
+	material_names = std::vector<std::string>(n);
+	for (std::string &name : material_names)
+		if (!r.read(name))
+			return false;
+	if (!r.read(spheres) || !r.read(sphere_keys) || !r.read(next_sphere_key) || !r.read(planes) || !r.read(n))
+		return false;
+	meshes = std::vector<Mesh>(n);
+	for (Mesh &mesh : meshes)
+		if (!mesh.load(r))
+			return false;
+	if (!r.read(n))
+		return false;
+	groups = std::vector<Group>(n);
+	for (Group &group : groups)
+		if (!group.load(r))
+			return false;
+	if (!r.read(instances) || !r.read(sphere_inclusion) || !r.read(interfaces) || !r.read(mesh_interfaces))
+		return false;
+	group_interfaces = std::vector<std::vector<Interface> >(groups.size());
+	for (std::vector<Interface> &group_interface : group_interfaces)
+		if (!r.read(group_interface))
+			return false;
+	if (!instance_bvh.load(r) || !r.read(sphere_accel) || !sphere_grid.load(r) || !sphere_bvh.load(r) || !sphere_dynamic.load(r)
+		|| !r.read(large_spheres))
+		return false;
+	
+	material_by_name.clear();
+	for (int i = 0; i < (long) material_names.size(); i++)
+		if (material_names[i] != "")
+			material_by_name[material_names[i]] = i;
+	group_by_name.clear();
+	for (int i = 0; i < (long) groups.size(); i++)
+		group_by_name[groups[i].name] = i;
+	return true;
+}
+
+std::string Scene::acceleratorInfo() const {
+	std::stringstream s;
+	switch (sphere_accel) {
+	case GRID_ACCEL:
+		s << "grid of " << sphere_grid.res[0] << "x" << sphere_grid.res[1] << "x" << sphere_grid.res[2] << " cells ("
+		  << (100 * sphere_grid.emptyCellCount()) / sphere_grid.cellCount() << "% empty, "
+		  << sphere_grid.indices.size() << " references, " << large_spheres.size() << " large spheres outside)";
+		break;
+	case BVH_ACCEL:
+		s << "BVH of " << sphere_bvh.nodeCount() << (sphere_bvh.compressed() ? " compressed" : "") << " nodes of width "
+		  << sphere_bvh.width();
+		break;
+	case DYNAMIC_ACCEL:
+		s << "dynamic BVH of " << sphere_dynamic.nodeCount() << " nodes (SAH cost " << sphere_dynamic.cost() << ", "
+		  << dynamic_rebuilds << " rebuilds after edits)";
+		break;
+	default:
+		s << "none (linear search)";
+	}
+	return s.str();
+}
+
+unsigned short Scene::addMaterial(const Material &m, const std::string &name) {
+	if (name != "") {
+		auto it = material_by_name.find(name);
+		if (it != material_by_name.end())
+			return it->second;
+	}
+	else {
+		// Unnamed materials are only added while loading, so a linear search is enough
+		for (unsigned i = 0; i < materials.size(); i++)
+			if (material_names[i] == "" && materials[i] == m)
+				return i;
+	}
+	if (materials.size() > std::numeric_limits<unsigned short>::max()) {
+		ErrorMessage() << "too many different materials in the scene!";
+		exit(EXIT_FAILURE);
+	}
+	materials.push_back(m);
+	material_names.push_back(name);
+	if (name != "")
+		material_by_name[name] = materials.size() - 1;
+	return materials.size() - 1;
+}
 
 bool Scene::precomputeSphereInclusion() {
-	// First sort spheres by radius
-	std::sort(spheres.begin(), spheres.end(), Sphere::compareByRadius);
+	// First sort spheres by radius, with their keys
+	std::vector<int> order(spheres.size());
+	for (int i = 0; i < (long) spheres.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&](int a, int b) {return Sphere::compareByRadius(spheres[a], spheres[b]);});
+	std::vector<Sphere> sorted(spheres.size());
+	std::vector<int> sorted_keys(spheres.size());
+	for (int i = 0; i < (long) spheres.size(); i++) {
+		sorted[i] = spheres[order[i]];
+		sorted_keys[i] = sphere_keys[order[i]];
+	}
+	spheres.swap(sorted);
+	sphere_keys.swap(sorted_keys);
+	return computeSphereInclusion();
+}
+
+bool Scene::computeSphereInclusion() {
+	// Visit the spheres by decreasing radius, the spheres which may contain a sphere being before it
+	// (this is the order of the spheres themselves, unless they were edited)
+	std::vector<int> order(spheres.size());
+	for (int i = 0; i < (long) spheres.size(); i++)
+		order[i] = i;
+	std::stable_sort(order.begin(), order.end(), [&](int a, int b) {return Sphere::compareByRadius(spheres[a], spheres[b]);});
 	sphere_inclusion = std::vector<int>(spheres.size(),0);
 	
-	for (int i = 1; i< (long) spheres.size(); i++) {
+	for (int k = 0; k < (long) order.size(); k++) {
+		int i = order[k];
 	    sphere_inclusion[i] = i; // Initially set a sphere to be included into itself
-		if (spheres[i]->material.refraction > 0) { // We only need to compute sphere inclusion for transparent spheres
-			for (int j = i-1; j >= 0; j--) {
-				if (spheres[j]->material.refraction <= 0) // Again, only consider transparent spheres
+		if (material(spheres[i]).refraction > 0) { // We only need to compute sphere inclusion for transparent spheres
+			for (int l = k-1; l >= 0; l--) {
+				int j = order[l];
+				if (material(spheres[j]).refraction <= 0) // Again, only consider transparent spheres
 					continue;
-				double dist = (spheres[i]->origin - spheres[j]->origin).norm();
-				if (dist < spheres[j]->radius - spheres[i]->radius) { // If the sphere is included into the other, store the info
+				real dist = (spheres[i].origin - spheres[j].origin).norm();
+				if (dist < spheres[j].radius - spheres[i].radius) { // If the sphere is included into the other, store the info
 					sphere_inclusion[i] = j;
 					break;
 				}
 				// If the spheres intersect without one being included into the other, there is a problem with the scene
-				if (dist < spheres[j]->radius + spheres[i]->radius) {
+				if (dist < spheres[j].radius + spheres[i].radius) {
 					return false;
 				}
 			}
 		}
 	}
+	
+	// Precompute the refraction data of the interface of every sphere with its surrounding medium
+	interfaces = std::vector<Interface>(spheres.size());
+	for (int i = 0; i < (long) spheres.size(); i++) {
+		real n_in = material(spheres[i]).refr_index;
+		// The medium around a sphere is the smallest sphere containing it, or the void
+		real n_around = 1.;
+		if (sphere_inclusion[i] != i)
+			n_around = material(spheres[sphere_inclusion[i]]).refr_index;
+		Interface &interface = interfaces[i];
+		interface.eta_enter = n_around / n_in;
+		interface.eta_exit = n_in / n_around;
+		interface.k0 = (n_around-n_in)*(n_around-n_in)/((n_around+n_in)*(n_around+n_in));
+		// Only the spheres inside another one of the same index skip Fresnel reflection, those in the void never do
+		interface.matched = (sphere_inclusion[i] != i && n_in == n_around);
+	}
+	// Meshes and the objects of groups are considered to be in the void
+	mesh_interfaces.clear();
+	for (const Mesh &mesh : meshes)
+		mesh_interfaces.push_back(voidInterface(material(mesh).refr_index));
+	group_interfaces = std::vector<std::vector<Interface> >(groups.size());
+	for (int i = 0; i < (long) groups.size(); i++) {
+		for (const Sphere &sphere : groups[i].spheres)
+			group_interfaces[i].push_back(voidInterface(material(sphere).refr_index));
+		for (const Mesh &mesh : groups[i].meshes)
+			group_interfaces[i].push_back(voidInterface(material(mesh).refr_index));
+	}
 	return true;
 }
 
-double Scene::MaxRadiusNewSphere(const Vector &origin) const {
-	double r_max = std::numeric_limits<double>::max();
+bool Scene::isDeterministic(bool fresnel, bool diffuse, bool deterministic) const {
+	// Check whether shading a surface with material mat and given interface involves random choices
+	auto deterministicSurface = [&](const Material &mat, const Interface &interface) {
+		real specularity = mat.specularity;
+		real refraction = mat.refraction;
+		// With Fresnel coefficients, a transparent surface is both reflective and refractive (and not diffuse)
+		if (fresnel && refraction > 0 && specularity <= 0. && !interface.matched)
+			return deterministic;
+		// Random choice between bouncing and refraction
+		if (!deterministic && refraction > 0 && specularity > 0)
+			return false;
+		// Indirect lighting is sampled in a random direction
+		if (diffuse && specularity + refraction < 1 && mat.diffusion_coeff > 0)
+			return false;
+		return true;
+	};
+	
+	for (int i = 0; i < (long) spheres.size(); i++)
+		if (!deterministicSurface(material(spheres[i]), interfaces[i]))
+			return false;
+	for (int i = 0; i < (long) planes.size(); i++)
+		if (!deterministicSurface(material(planes[i]), opaque_interface))
+			return false;
+	for (int i = 0; i < (long) meshes.size(); i++)
+		if (!deterministicSurface(material(meshes[i]), mesh_interfaces[i]))
+			return false;
+	for (int i = 0; i < (long) groups.size(); i++) {
+		for (int j = 0; j < (long) groups[i].spheres.size(); j++)
+			if (!deterministicSurface(material(groups[i].spheres[j]), group_interfaces[i][j]))
+				return false;
+		for (int j = 0; j < (long) groups[i].meshes.size(); j++)
+			if (!deterministicSurface(material(groups[i].meshes[j]), group_interfaces[i][groups[i].spheres.size() + j]))
+				return false;
+	}
+	return true;
+}
+
+int Scene::convertLargeSpheres(real min_radius, const Vector &camera) {
+	std::vector<Sphere> kept;
+	std::vector<int> kept_keys;
+	int converted = 0;
+	for (int i = 0; i < (long) spheres.size(); i++) {
+		const Sphere &sphere = spheres[i];
+		Vector d = camera - sphere.origin;
+		real dist = d.norm();
+		if (sphere.radius < min_radius || material(sphere).refraction > 0 || sphere.texture != Sphere::UNIFORM
+			|| dist <= sphere.radius) {
+			kept.push_back(sphere);
+			kept_keys.push_back(sphere_keys[i]);
+			continue;
+		}
+		// Tangent plane at the point of the sphere closest to the camera
+		addPlane(Plane(sphere.origin + (sphere.radius / dist) * d, d, sphere.material));
+		++converted;
+	}
+	spheres = kept;
+	sphere_keys = kept_keys;
+	return converted;
+}
+
+real Scene::MaxRadiusNewSphere(const Vector &origin) const {
+	real r_max = std::numeric_limits<real>::max();
 	for (int i = 0; i<(long) spheres.size(); i++) {
 		// Check if the point is in the sphere
-		double dist = (spheres[i]->origin - origin).norm();
-		if (dist < spheres[i]->radius) {
+		real dist = (spheres[i].origin - origin).norm();
+		if (dist < spheres[i].radius) {
 			// If the point is in a non-transparent sphere, returns -1
-			if (spheres[i]->material.refraction > 0)
+			if (material(spheres[i]).refraction > 0)
 				return -1;
 			// If the sphere is transparent, take the radius into account
-			r_max = std::min(r_max, spheres[i]->radius - dist);
+			r_max = std::min(r_max, spheres[i].radius - dist);
 		}
 		else
-			r_max = std::min(r_max, dist - spheres[i]->radius);
+			r_max = std::min(r_max, dist - spheres[i].radius);
 	}
 	return r_max;
 }
 
+std::string Scene::sphereToString(const Sphere &sphere) const {
+	std::stringstream s;
+	s << "S " << sphere.origin.x << " "
+	  << sphere.origin.y << " "
+	  << sphere.origin.z << " "
+	  << sphere.radius << " ";
+	const Material &mat = material(sphere);
+	if (sphere.texture == Sphere::MULTICOLOR)
+		s << "multicolor\n";
+	else if (material_names[sphere.material] != "")
+		s << material_names[sphere.material] << "\n";
+	else
+		s << "object " 
+		  << mat.color.x << " "
+		  << mat.color.y << " "
+		  << mat.color.z << "\n";
+	return s.str();
+}
+
+std::string Scene::meshToString(const Mesh &mesh) const {
+	std::stringstream s;
+	s << "M " << mesh.position.x << " " << mesh.position.y << " " << mesh.position.z << " " << mesh.scale << " "
+	  << mesh.file << " ";
+	if (material_names[mesh.material] != "")
+		s << material_names[mesh.material] << "\n";
+	else
+		s << "object " 
+		  << material(mesh).color.x << " "
+		  << material(mesh).color.y << " "
+		  << material(mesh).color.z << "\n";
+	return s.str();
+}
+
 std::string Scene::toString(const Vector &camera, std::string name) const {
 	std::stringstream s;
 	if (name != "")
@@ -56,104 +504,277 @@ std::string Scene::toString(const Vector &camera, std::string name) const {
 	s << "C " << camera.x << " " << camera.y << " " << camera.z << "\n";
 	s << "L " << light.position.x << " " << light.position.y << " " << light.position.z << " "
 	  << light.intensity << "\n";
-	for (int i = 0; i < (long) spheres.size(); i++) {
-		s << "S " << spheres[i]->origin.x << " "
-			  << spheres[i]->origin.y << " "
-			  << spheres[i]->origin.z << " "
-			  << spheres[i]->radius << " ";
-		bool found = false;
-		// Check for the name of the material of the sphere
-		for (const auto &M : Materials::by_name) {
-			if (M.second == spheres[i]->material) {
-				s << M.first << "\n";
-				found = true;
-				break;
-			}
-		}
-		if (!found)
+	for (const Sphere &sphere : spheres)
+		s << sphereToString(sphere);
+	for (const Plane &plane : planes) {
+		Vector P = plane.offset * plane.normal; // Point of the plane closest to the origin
+		s << "P " << P.x << " " << P.y << " " << P.z << " "
+		  << plane.normal.x << " " << plane.normal.y << " " << plane.normal.z << " ";
+		if (material_names[plane.material] != "")
+			s << material_names[plane.material] << "\n";
+		else
 			s << "object " 
-			  << spheres[i]->material.color.x << " "
-			  << spheres[i]->material.color.y << " "
-			  << spheres[i]->material.color.z << "\n";
+			  << material(plane).color.x << " "
+			  << material(plane).color.y << " "
+			  << material(plane).color.z << "\n";
+	}
+	for (const Mesh &mesh : meshes)
+		s << meshToString(mesh);
+	for (const Group &group : groups) {
+		s << "G " << group.name << "\n";
+		for (const Sphere &sphere : group.spheres)
+			s << sphereToString(sphere);
+		for (const Mesh &mesh : group.meshes)
+			s << meshToString(mesh);
+		s << "E\n";
+	}
+	for (const Instance &instance : instances) {
+		const Transform &transform = instance.transform;
+		s << "I " << groups[instance.group].name << " " << transform.translation.x << " " << transform.translation.y << " "
+		  << transform.translation.z << " " << transform.scale << " " << instance.rx << " " << instance.ry << " " << instance.rz << "\n";
 	}
 	return s.str();
 }
 
+// No intersection
+static Scene::Intersection noIntersection() {
+	Scene::Intersection inter;
+	inter.t = 0;
+	inter.index = 0;
+	inter.primitive = 0;
+	inter.instance = -1;
+	inter.kind = Scene::SPHERE;
+	inter.entrance = false;
+	return inter;
+}
+
 Scene::Intersection Scene::intersect(const Ray &ray) const {
-	double t = 0;
-	int s = 0;
-	bool entrance = false;
-	// Check for intersection for all spheres of the scene and keep the closest
-	for (int i = 0; i< (long) spheres.size(); i++) {
-		// Take intersection with sphere i
-		Sphere::Intersection inter = spheres[i]->intersect(ray);
-		// Take minimum of positive t's
-		if (inter.first > 0 && (t == 0 || inter.first < t)) {
-			t = inter.first;
-			s = i;
-			entrance = inter.second;
+	Scene::Intersection inter = noIntersection();
+	intersectSpheres(ray, std::numeric_limits<real>::infinity(), inter);
+	intersectOthers(ray, std::numeric_limits<real>::infinity(), inter);
+	return inter;
+}
+
+Scene::Intersection Scene::intersect(const Ray &ray, const SphereRaster &raster) const {
+	Scene::Intersection inter = noIntersection();
+	intersectSpheres(ray, std::numeric_limits<real>::infinity(), inter, &raster);
+	intersectOthers(ray, std::numeric_limits<real>::infinity(), inter);
+	return inter;
+}
+
+void Scene::intersectPacket(const Ray *rays, int n, Intersection *inters, const real *t_limits) const {
+	real t_max[PACKET_SIZE];
+	for (int k = 0; k < n; k++) {
+		inters[k] = noIntersection();
+		t_max[k] = t_limits ? t_limits[k] : std::numeric_limits<real>::infinity();
+	}
+	// The spheres of a BVH are found for the whole packet, with the same tests as in intersectSpheres
+	bool packet = sphere_accel == BVH_ACCEL && sphere_bvh.traversePacket(rays, n, t_max
+																		  , [&](unsigned first, unsigned count, unsigned mask) {
+		for (unsigned j = first; j < first + count; j++) {
+			const Sphere &sphere = spheres[sphere_bvh.indices[j]];
+			for (unsigned m = mask; m != 0; m &= m - 1) {
+				int k = __builtin_ctz(m);
+				Sphere::Intersection s = sphere.intersect(rays[k]);
+				if (s.first > 0 && s.first < t_max[k]) {
+					inters[k].t = t_max[k] = s.first;
+					inters[k].index = sphere_bvh.indices[j];
+					inters[k].entrance = s.second;
+				}
+			}
+		}
+	});
+	for (int k = 0; k < n; k++) {
+		if (!packet)
+			intersectSpheres(rays[k], t_max[k], inters[k]);
+		intersectOthers(rays[k], t_limits ? t_limits[k] : std::numeric_limits<real>::infinity(), inters[k]);
+	}
+}
+
+void Scene::intersectSpheres(const Ray &ray, real t_max, Intersection &inter, const SphereRaster *raster) const {
+	// Check for intersection with the spheres of the scene and keep the closest
+	auto testSphere = [&](int i, real t_max) {
+		Sphere::Intersection s = spheres[i].intersect(ray);
+		if (s.first > 0 && s.first < t_max) {
+			inter.t = s.first;
+			inter.index = i;
+			inter.entrance = s.second;
+			return s.first;
+		}
+		return t_max;
+	};
+	// The rays covered by the raster only test the spheres of their tile
+	if (raster && raster->traverse(ray, t_max, [&](unsigned first, unsigned count, real t) {
+			for (unsigned k = first; k < first + count; k++)
+				t = testSphere(raster->indices[k], t);
+			return t;
+		}))
+		return;
+	switch (sphere_accel) {
+	case GRID_ACCEL:
+		for (int i : large_spheres)
+			t_max = testSphere(i, t_max);
+		sphere_grid.traverse(ray, t_max, [&](unsigned first, unsigned count, real t) {
+			for (unsigned k = first; k < first + count; k++)
+				t = testSphere(sphere_grid.indices[k], t);
+			return t;
+		});
+		break;
+	case BVH_ACCEL:
+		sphere_bvh.traverse(ray, t_max, [&](unsigned first, unsigned count, real t) {
+			for (unsigned k = first; k < first + count; k++)
+				t = testSphere(sphere_bvh.indices[k], t);
+			return t;
+		});
+		break;
+	case DYNAMIC_ACCEL:
+		sphere_dynamic.traverse(ray, t_max, [&](unsigned i, real t) {return testSphere(i, t);});
+		break;
+	default:
+		for (int i = 0; i < (long) spheres.size(); i++)
+			t_max = testSphere(i, t_max);
+	}
+}
+
+void Scene::intersectOthers(const Ray &ray, real t_max, Intersection &inter) const {
+	// Planes
+	for (int i = 0; i< (long) planes.size(); i++) {
+		Plane::Intersection p = planes[i].intersect(ray);
+		if (p.first > 0 && p.first < t_max && (inter.t == 0 || p.first < inter.t)) {
+			inter.t = p.first;
+			inter.index = i;
+			inter.kind = PLANE;
+			inter.entrance = p.second;
 		}
 	}
 	
-	Scene::Intersection inter;
-	inter.t = t;
-	inter.sphere = s;
-	inter.entrance = entrance;
+	// And the meshes
+	for (int i = 0; i< (long) meshes.size(); i++) {
+		unsigned triangle;
+		real t = meshes[i].intersect(ray, (inter.t > 0) ? inter.t : t_max, triangle);
+		if (t > 0) {
+			inter.t = t;
+			inter.index = i;
+			inter.primitive = triangle;
+			inter.kind = TRIANGLE;
+			// The ray enters a solid mesh if it comes from the outside, and always enters a surface
+			inter.entrance = !meshes[i].solid || meshes[i].normal(triangle).sp(ray.direction) < 0;
+		}
+	}
 	
-	return inter;
+	// And the instances, through the top level BVH
+	instance_bvh.traverse(ray, (inter.t > 0) ? inter.t : t_max, [&](unsigned first, unsigned count, real t_max) {
+		for (unsigned k = first; k < first + count; k++) {
+			unsigned i = instance_bvh.indices[k];
+			const Transform &transform = instances[i].transform;
+			Group::Intersection g = groups[instances[i].group].intersect(transform.rayBack(ray), t_max / transform.scale);
+			if (g.t > 0) {
+				t_max = g.t * transform.scale;
+				inter.t = t_max;
+				inter.index = g.index;
+				inter.primitive = g.primitive;
+				inter.instance = i;
+				inter.kind = g.triangle ? TRIANGLE : SPHERE;
+				inter.entrance = g.entrance;
+			}
+		}
+		return t_max;
+	});
+}
+
+void Scene::sphereSurface(const Sphere &sphere, const Vector &P, const Interface *interface, Surface &s) const {
+	s.P = sphere.reproject(P);
+	s.nor = (s.P - sphere.origin).normalize();
+	s.eps = sphere.errorBound();
+	s.mat = &material(sphere);
+	s.color = sphere.color(s.P, *s.mat);
+	s.interface = interface;
+}
+
+void Scene::triangleSurface(const Mesh &mesh, unsigned triangle, const Vector &P, const Vector &direction
+							, const Interface *interface, Surface &s) const {
+	s.P = mesh.reproject(triangle, P);
+	s.nor = mesh.normal(triangle);
+	// The normal of a surface faces the incoming ray
+	if (!mesh.solid && s.nor.sp(direction) > 0)
+		s.nor = -s.nor;
+	s.eps = mesh.errorBound(triangle, s.P);
+	s.mat = &material(mesh);
+	s.color = s.mat->color;
+	s.interface = interface;
+}
+
+Scene::Surface Scene::surface(const Ray &ray, const Intersection &inter) const {
+	Surface s;
+	if (inter.instance >= 0) {
+		// Compute the surface in the coordinates of the group, then transform it to the world
+		const Instance &instance = instances[inter.instance];
+		const Group &group = groups[instance.group];
+		const std::vector<Interface> &group_interface = group_interfaces[instance.group];
+		const Transform &transform = instance.transform;
+		Ray r = transform.rayBack(ray);
+		Vector P = r.origin + (inter.t / transform.scale) * r.direction;
+		if (inter.kind == TRIANGLE)
+			triangleSurface(group.meshes[inter.index], inter.primitive, P, r.direction
+							, &group_interface[group.spheres.size() + inter.index], s);
+		else
+			sphereSurface(group.spheres[inter.index], P, &group_interface[inter.index], s);
+		s.P = transform.point(s.P);
+		s.nor = transform.rotate(s.nor);
+		// Add the error of the transformation of P and of rays starting close to it
+		s.eps = transform.scale * s.eps + errorGamma(8) * 3 * (s.P.maxAbs() + transform.translation.maxAbs());
+		return s;
+	}
+	
+	Vector P = ray.origin + inter.t * ray.direction;
+	if (inter.kind == PLANE) {
+		const Plane &plane = planes[inter.index];
+		s.P = plane.reproject(P);
+		s.nor = plane.normal;
+		s.eps = plane.errorBound(s.P);
+		s.mat = &material(plane);
+		s.color = s.mat->color;
+		s.interface = &opaque_interface;
+	}
+	else if (inter.kind == TRIANGLE)
+		triangleSurface(meshes[inter.index], inter.primitive, P, ray.direction, &mesh_interfaces[inter.index], s);
+	else
+		sphereSurface(spheres[inter.index], P, &interfaces[inter.index], s);
+	return s;
 }
 
-Vector Scene::getColor(const Ray &ray, int n, bool fresnel, bool diffuse, bool deterministic) const {
+Vector Scene::getColor(const Ray &ray, const Intersection &inter, int n, bool fresnel, bool diffuse, bool deterministic, RayBudget *budget, real weight) const {
 	Vector res(0,0,0);
-	double eps = 0.001; // Use to avoid noise
-	Scene::Intersection inter = intersect(ray); // Retrieve closest intersection between spheres and input ray
-	double &t = inter.t;
-	const Sphere &sphere = *spheres[inter.sphere];
 	
-	if (t > 0) { // If it intersects something, compute the color of the pixel (otherwise it will return black)
-		Vector P = ray.origin + t * ray.direction; // P is the intersection point between the sphere and input ray
-		Vector inc = (P - ray.origin).normalize(); // Incoming vector
-		Vector nor = (P - sphere.origin).normalize(); // Normal vector
-		// Slightly shifted points to avoid noise effects
+	if (inter.t > 0) { // If it intersects something, compute the color of the pixel (otherwise it will return black)
+		Surface surf = surface(ray, inter);
+		const Material &mat = *surf.mat;
+		const Vector &P = surf.P; // P is the intersection point between the object and input ray
+		Vector inc = ray.direction; // Incoming vector
+		const Vector &nor = surf.nor; // Normal vector
+		// Slightly shifted points to avoid self-intersections, by more than the error bound on P
+		real eps = surf.eps;
 		Vector P1 = P + eps * nor;
 		Vector P2 = P - eps * nor;
 		
-		double specularity = sphere.material.specularity;
-		double refraction = sphere.material.refraction;
+		real specularity = mat.specularity;
+		real refraction = mat.refraction;
 		
 		/*** Computing Fresnel coefficients ***
-		  If the material of the sphere is (partially) transparent and not specular, if the 
+		  If the material of the object is (partially) transparent and not specular, if the 
 		  no-fresnel option is disable and if the refractive index of the sphere is different from 
 		  the refractive index just outside of the sphere, we compute fresnel coefficients according
 		  to Schlick's formulas.
 		*/
-		if (fresnel && (sphere_inclusion[inter.sphere] == inter.sphere || sphere.material.refr_index != spheres[sphere_inclusion[inter.sphere]]->material.refr_index) && sphere.material.refraction > 0 && sphere.material.specularity <= 0.) {
-			double n_inc, n_out;
-			Vector nor_refl = nor;
-			// First compute refractive index of the incoming and outgoing materials
-			if (inter.entrance) {
-				n_inc = 1.;
-				// If the ray enters a sphere wich is included into another sphere, the in refractive index is
-				// the index of the sphere it is included into
-				if (sphere_inclusion[inter.sphere] != inter.sphere)
-					n_inc = spheres[sphere_inclusion[inter.sphere]]->material.refr_index;
-				n_out = sphere.material.refr_index;
-			}
-			else {
-				n_inc = sphere.material.refr_index;
-				n_out = 1.;
-				// If the ray leaves a sphere wich is included into another sphere, the out refractive index is
-				// the index of the sphere it is included into
-				
-				if (sphere_inclusion[inter.sphere] != inter.sphere)
-					n_out = spheres[sphere_inclusion[inter.sphere]]->material.refr_index;
-				nor_refl = - nor_refl;
-			}
-			double k0 = (n_inc-n_out)*(n_inc-n_out)/((n_inc+n_out)*(n_inc+n_out));
-			double l = nor_refl.sp(inc);
+		const Interface &interface = *surf.interface;
+		if (fresnel && !interface.matched && mat.refraction > 0 && mat.specularity <= 0.) {
+			real k0 = interface.k0;
+			real l = nor.sp(inc);
 			if (l < 0.)
 				l = -l;
-			refraction = 1.-(k0 + (1.-k0) * pow(1.-l, 5));
+			real m = 1 - l;
+			real m2 = m * m;
+			refraction = 1.-(k0 + (1.-k0) * m2 * m2 * m);
 			specularity = 1. - refraction;
 		}
 		
@@ -170,45 +791,42 @@ Vector Scene::getColor(const Ray &ray, int n, bool fresnel, bool diffuse, bool d
 		}
 		
 		// If specular, bounce if possible
-		if (inter.entrance && specularity > 0 && n>0) {
+		if (inter.entrance && specularity > 0 && n>0 && RayBudget::take(budget, weight * specularity * mat.spec_color.maxAbs())) {
 			Ray r;
 			r.origin = P1;
 			r.direction = (inc - 2 * inc.sp(nor) * nor).normalize();
-			res = getColor(r, n-1, fresnel, diffuse); // Compute recursively the color
-			res = specularity * res * sphere.material.spec_color; // Multiply by the specularity color
+			res = getColor(r, n-1, fresnel, diffuse, deterministic, budget, weight * specularity * mat.spec_color.maxAbs()); // Compute recursively the color
+			res = specularity * res * mat.spec_color; // Multiply by the specularity color
 		}
 		
-		// If refraction, compute the refracted ray
-		if (refraction > 0. && n>0) {			
+		// If refraction, compute the refracted ray. Its weight does not include the coefficients of the
+		// sphere when leaving it, since they are applied at the entrance only
+		real w_refr = inter.entrance ? weight * refraction * mat.refr_color.maxAbs() : weight;
+		if (refraction > 0. && n>0 && RayBudget::take(budget, w_refr)) {			
 			// First simulate entrance of the sphere
 			Ray r;
-			double n_inc, n_out;
+			real eta; // Ratio of the incoming and outgoing refractive indices
 			Vector nor_refl = nor;
 			
-			// Compute origin points of the new ray, in/out refractive indices and normal vectors depending
+			// Compute origin points of the new ray, ratio of refractive indices and normal vectors depending
 			// on whether we enter or leave the sphere
 			if (inter.entrance) {
 				r.origin = P2;
-				n_inc = 1.;
-				if (sphere_inclusion[inter.sphere] != inter.sphere)
-					n_inc = spheres[sphere_inclusion[inter.sphere]]->material.refr_index;
-				n_out = sphere.material.refr_index;
+				eta = interface.eta_enter;
 			} 
 			else {
 				r.origin = P1;
-				n_inc = sphere.material.refr_index;
-				n_out = 1.;
-				if (sphere_inclusion[inter.sphere] != inter.sphere)
-					n_out = spheres[sphere_inclusion[inter.sphere]]->material.refr_index;
+				eta = interface.eta_exit;
 				nor_refl = - nor_refl;
 			}
 			
-			double norm_coeff = 1 - pow(n_inc/n_out,2) * (1 - pow(inc.sp(nor_refl),2));
+			real cos_inc = inc.sp(nor_refl);
+			real norm_coeff = 1 - eta * eta * (1 - cos_inc * cos_inc);
 			if (norm_coeff >= 0) {  // only reflexion in fact if the coeff is negative
-				r.direction = ((n_inc / n_out) * inc - ((n_inc / n_out) * inc.sp(nor_refl) + sqrt(norm_coeff)) * nor_refl).normalize(); // Direction of refracted ray
-				Vector color = getColor(r, n-1, fresnel, diffuse); // Compute the color recursively
+				r.direction = (eta * inc - (eta * cos_inc + sqrt(norm_coeff)) * nor_refl).normalize(); // Direction of refracted ray
+				Vector color = getColor(r, n-1, fresnel, diffuse, deterministic, budget, w_refr); // Compute the color recursively
 				if (inter.entrance) // Apply the multiplicative coeffs only once (at the entrance of the sphere)
-					res = res + refraction * color * sphere.material.refr_color;
+					res = res + refraction * color * mat.refr_color;
 				else
 					res = res + color;
 			}
@@ -218,8 +836,8 @@ Vector Scene::getColor(const Ray &ray, int n, bool fresnel, bool diffuse, bool d
 				else
 					r.origin = P2;
 				r.direction = (inc - 2 * inc.sp(nor) * nor).normalize();
-				res = getColor(r, n-1, fresnel, diffuse);
-				res = refraction * res * sphere.material.refr_color;
+				res = getColor(r, n-1, fresnel, diffuse, deterministic, budget, weight * refraction * mat.refr_color.maxAbs());
+				res = refraction * res * mat.refr_color;
 			}
 		}
 		
@@ -229,13 +847,14 @@ Vector Scene::getColor(const Ray &ray, int n, bool fresnel, bool diffuse, bool d
 			Scene::Intersection obstacle = intersect(Ray(P1,(light.position-P1).normalize()));
 			// If there is no obstacle on the path to the light, compute direct lightning
 			if (obstacle.t <= 0 || obstacle.t > (light.position-P1).norm()) {
-				double c = std::max(0., (light.position-P).normalize().sp(nor) * light.intensity / ((light.position-P).snorm())); // Compute intensity of light received on the point
+				real c = std::max((real) 0, (light.position-P).normalize().sp(nor) * light.intensity / ((light.position-P).snorm())); // Compute intensity of light received on the point
 				
-				res = res + c * (1 - specularity -refraction) * sphere.color(P);
+				res = res + c * (1 - specularity -refraction) * surf.color;
 			}
 			
 			// Now compute indirect lightning
-			if (diffuse && n > 0) {
+			real w_diff = weight * (1./PI) * mat.diffusion_coeff * surf.color.maxAbs();
+			if (diffuse && n > 0 && RayBudget::take(budget, w_diff)) {
 				Ray r;
 				r.origin = P1;
 				r.direction = generateUniformRandomVector(); // Get random direction
@@ -244,7 +863,7 @@ Vector Scene::getColor(const Ray &ray, int n, bool fresnel, bool diffuse, bool d
 				Vector w = nor.vp(v);
 				r.direction.convertCoordinateSystem(v, w, nor); // Convert to canonical coordinates
 				r.direction = r.direction.normalize();
-				res = res + (1./PI) * sphere.material.diffusion_coeff * sphere.color(P) * getColor(r, n-1, fresnel, diffuse); // Compute recursively the color and take diffusion into account
+				res = res + (1./PI) * mat.diffusion_coeff * surf.color * getColor(r, n-1, fresnel, diffuse, deterministic, budget, w_diff); // Compute recursively the color and take diffusion into account
 			}
 		}
 	}
@@ -2,63 +2,255 @@
 #define SCENE_HPP
 
 #include "sphere.hpp"
+#include "plane.hpp"
+#include "mesh.hpp"
+#include "group.hpp"
+#include "grid.hpp"
+#include "dynamic_bvh.hpp"
+#include "raster.hpp"
 #include "ray.hpp"
 #include "vector.hpp"
 #include <vector>
-#include <memory>
+#include <map>
+#include <string>
 #include <utility>
 
 class Light {
 public:
-	Light(Vector p, double i) : position(p), intensity(i) {}
+	Light(Vector p, real i) : position(p), intensity(i) {}
 	
 	Vector position;
-	double intensity;
+	real intensity;
 };
 
 /** Main class of the raytracer
-	Contains the scene (light, spheres) and methods computing the color of a given ray
+	Contains the scene (light, spheres, planes, meshes) and methods computing the color of a given ray
 */
 class Scene {
 public:
+	// Kinds of objects of the scene
+	enum Kind : unsigned char {SPHERE, PLANE, TRIANGLE};
+	
 	// Struct containing all the info needed to compute intersection between a ray and a scene
 	struct Intersection {
-		double t;
-		int sphere;
+		real t;
+		int index; // Index of the object in the list of objects of its kind
+		unsigned primitive; // Index of the triangle in its mesh
+		int instance; // Index of the instance if the object belongs to a group (index is then relative to the group), -1 otherwise
+		Kind kind;
 		bool entrance;
 	};
 	
-	Scene() : light(Vector(0,0,0),0) {}
-	Scene(Light l) : light(l) {}
+	Scene() : light(Vector(0,0,0),0) {addMaterial(Materials::neutral, "neutral");}
+	Scene(Light l) : light(l) {addMaterial(Materials::neutral, "neutral");}
 	
 	void setLight(Light l) {light = l;}
-	void addSphere(Sphere *s) {spheres.push_back(std::unique_ptr<Sphere>(s));}
+	void addSphere(const Sphere &s) {
+		spheres.push_back(s);
+		sphere_keys.push_back(next_sphere_key++);
+	}
+	void addPlane(const Plane &p) {planes.push_back(p);}
+	void addMesh(Mesh &&m) {
+		m.solid = (materials[m.material].refraction > 0);
+		meshes.push_back(std::move(m));
+	}
+	
+	// Settings of the BVHs built by the scene (for groups, instances and spheres)
+	void setBVHSettings(const BVH::Settings &s) {bvh_settings = s;}
+	
+	// Add a group of objects, whose BVH is built, and return its index. Its objects are only rendered
+	// through instances.
+	int addGroup(Group &&g);
+	int findGroup(const std::string &name) const; // -1 if there is no group with this name
+	void addInstance(const Instance &i) {instances.push_back(i);}
+	const std::vector<Group> &getGroups() const {return groups;}
+	const std::vector<Instance> &getInstances() const {return instances;}
+	
+	// Acceleration structures for the spheres of the scene. The dynamic BVH is only chosen explicitly or by editing.
+	enum Accelerator : unsigned char {LINEAR_ACCEL, GRID_ACCEL, BVH_ACCEL, DYNAMIC_ACCEL, AUTO_ACCEL};
+	
+	// Build the acceleration structures: the one given for the spheres (chosen from the statistics of the scene
+	// for AUTO_ACCEL), and the top level BVH over the instances. Must be called once the scene is loaded, after
+	// precomputeSphereInclusion (which sorts the spheres) and before rendering. Returns the accelerator used for the spheres.
+	Accelerator buildAccelerationStructures(Accelerator accel = AUTO_ACCEL);
+	std::string acceleratorInfo() const; // Description of the accelerator of the spheres
+	size_t accelerationMemory() const; // Size in bytes of all the acceleration structures
+	
+	/* Edits of the spheres between frames, once the acceleration structures are built. The spheres are changed
+	   at once, but the acceleration structure and the refraction data are only updated by commitEdits, which
+	   must be called before rendering. The first edit switches the spheres to the dynamic BVH, which is refitted
+	   after moves, updated in place by insertions and removals, and built again when this degraded it too much. */
+	long sphereCount() const {return spheres.size();}
+	const Sphere &getSphere(int i) const {return spheres[i];}
+	// Number of the i-th sphere in the order in which the spheres were added (by addSphere, then insertSphere),
+	// which identifies it although spheres are sorted, converted to planes and removed
+	int sphereKey(int i) const {return sphere_keys[i];}
+	void moveSphere(int i, const Vector &origin, real radius);
+	int insertSphere(const Sphere &s); // Returns the index of the new sphere
+	void removeSphere(int i); // The last sphere takes the index i
+	// Returns false if the edited scene is invalid (see precomputeSphereInclusion)
+	bool commitEdits();
+	
+	// Write the whole scene, once precomputed and with its acceleration structures, to a cache file identified
+	// by key, together with the camera. Returns false if the file cannot be written.
+	bool saveCache(const std::string &path, const std::string &key, const Vector &camera) const;
+	// Load a scene written by saveCache, returns false if the file does not exist or was written for another key
+	// or by another version of the program (the scene is then left in an unspecified state)
+	bool loadCache(const std::string &path, const std::string &key, Vector &camera);
+	
+	// Replace the opaque spheres of radius at least min_radius which do not contain the camera by their
+	// tangent plane at the point closest to the camera, and returns the number of converted spheres.
+	// Scenes use such spheres as walls, and planes are both cheaper and more precise.
+	int convertLargeSpheres(real min_radius, const Vector &camera);
+	
+	// Intern a material in the material table of the scene and return its index. Materials with a
+	// name are identified by their name, unnamed ones by their value. The neutral material has index 0.
+	unsigned short addMaterial(const Material &m, const std::string &name = "");
+	const Material &material(const Sphere &s) const {return materials[s.material];}
+	const Material &material(const Plane &p) const {return materials[p.material];}
+	const Material &material(const Mesh &m) const {return materials[m.material];}
+	
+	/* Limits on the ray tree followed by getColor for one primary ray. This is mostly useful in deterministic
+	   mode, where both the reflected and refracted rays are traced at each hit and the tree grows exponentially. */
+	struct RayBudget {
+		RayBudget(real w = 0, long m = 0) : min_weight(w), max_rays(m), rays(0), pruned_weight(0), pruned_cap(0) {}
+		
+		// Returns true if a branch of weight w may be traced according to budget (always if there is none),
+		// and counts it as traced or pruned
+		static bool take(RayBudget *budget, real w) {
+			if (!budget)
+				return true;
+			if (w < budget->min_weight) {
+				++budget->pruned_weight;
+				return false;
+			}
+			if (budget->max_rays > 0 && budget->rays >= budget->max_rays) {
+				++budget->pruned_cap;
+				return false;
+			}
+			++budget->rays;
+			return true;
+		}
+		
+		real min_weight; // Branches with a smaller weight (bound on their contribution to the color) are dropped
+		long max_rays; // Maximum number of secondary rays for one primary ray (0 for no limit)
+		long rays; // Number of secondary rays traced for the current primary ray
+		long pruned_weight, pruned_cap; // Number of branches dropped because of their weight or because of max_rays
+	};
+	
+	// Refraction data of the interface between a sphere and the medium around it
+	struct Interface {
+		real eta_enter; // Ratio n_inc / n_out for a ray entering the sphere
+		real eta_exit; // Ratio n_inc / n_out for a ray leaving the sphere
+		real k0; // Reflectance at normal incidence in Schlick's formula (the same in both directions)
+		bool matched; // True if the refractive indices on both sides are equal (no Fresnel reflection)
+	};
 	
 	// Fill the vector sphere_inclusion such that spere_inclusion[i] = j if and only if
 	// the j-th sphere is the smallest sphere containing the i-th sphere.
-	// We use this precomputation step in order to obtain the refractive index outside of all spheres
+	// We use this precomputation step in order to obtain the refractive index outside of all spheres,
+	// and fill the vectors interfaces, mesh_interfaces and group_interfaces accordingly (meshes and objects
+	// of groups are considered to be in the void)
 	// If there are two spheres which intersect and such that none of the two is included into the other,
 	// this method returns false (the scene is invalid!)
 	bool precomputeSphereInclusion();
 	
+	// Returns true if getColor always returns the same color for a given ray with these options, in which case
+	// taking several samples of a fixed camera ray is useless. Must be called after precomputeSphereInclusion.
+	bool isDeterministic(bool fresnel, bool diffuse, bool deterministic) const;
+	
     // Returns the maximum radius of a sphere with the given origin such that
 	// the sphere would be included in existing spheres, and returns -1 if the origin
 	// is in a non-transparent sphere
-	double MaxRadiusNewSphere(const Vector &origin) const;
+	real MaxRadiusNewSphere(const Vector &origin) const;
 	
 	// Export scene to string according to the specification format
 	std::string toString(const Vector &camera, std::string name = "") const; 
 	
-	// Compute the closest intersection between the input ray and all the spheres of the scene
+	// Compute the closest intersection between the input ray and all the objects of the scene
 	Intersection intersect(const Ray &ray) const;
 	
+	// Same for a packet of n <= PACKET_SIZE coherent rays (camera rays of neighbouring pixels, shadow rays toward
+	// the light...), which traverse the BVH of the spheres together. If t_limits is given, the intersections of
+	// ray k beyond t_limits[k] may be missed. The rays are traced one by one when their directions diverge.
+	static constexpr int PACKET_SIZE = BVH::MAX_PACKET;
+	void intersectPacket(const Ray *rays, int n, Intersection *inters, const real *t_limits = nullptr) const;
+	
+	// Rasterize the spheres on the screen of the camera (see SphereRaster), for the intersection below. The raster
+	// must be built again when the spheres or the camera change.
+	void rasterizeSpheres(SphereRaster &raster, const Vector &camera, real focal, int width, int height, int tile_size) const {
+		raster.build(spheres, camera, focal, width, height, tile_size);
+	}
+	// Same as intersect for a camera ray, whose spheres are only searched among those of its tile in raster
+	Intersection intersect(const Ray &ray, const SphereRaster &raster) const;
+	
 	// Main function of the raytracer: returns the color of the input ray simulated in the scene with
 	// recursion depth n. The use of Fresnel coefficients can be toggled off.
-	Vector getColor(const Ray &r, int n, bool fresnel = true, bool diffuse = true, bool deterministic = false) const;
+	// If budget is given, the branches of the ray tree are pruned according to it, weight being the
+	// weight of the input ray in the final color.
+	Vector getColor(const Ray &r, int n, bool fresnel = true, bool diffuse = true, bool deterministic = false
+					, RayBudget *budget = nullptr, real weight = 1) const {
+		return getColor(r, intersect(r), n, fresnel, diffuse, deterministic, budget, weight);
+	}
+	
+	// Same as above when the closest intersection inter of the ray is already known (e.g. cached primary hits)
+	Vector getColor(const Ray &r, const Intersection &inter, int n, bool fresnel = true, bool diffuse = true, bool deterministic = false
+					, RayBudget *budget = nullptr, real weight = 1) const;
 	
 private:
-	std::vector<std::unique_ptr<Sphere> > spheres;
+	friend class Wavefront; // Shades batches of rays with the same computations as getColor
+	
+	// Local description of the surface at an intersection point
+	struct Surface {
+		Vector P; // Intersection point, projected back onto the surface
+		Vector nor; // Outward normal
+		real eps; // Bound on the error of P, by which spawned rays are offset
+		Vector color; // Color of the surface at P
+		const Material *mat;
+		const Interface *interface;
+	};
+	
+	// Parts of intersect: closest sphere before t_max, then the closer planes, meshes and instances
+	void intersectSpheres(const Ray &ray, real t_max, Intersection &inter, const SphereRaster *raster = nullptr) const;
+	void intersectOthers(const Ray &ray, real t_max, Intersection &inter) const;
+	
+	// Compute the surface at the intersection inter (with t > 0) of the input ray
+	Surface surface(const Ray &ray, const Intersection &inter) const;
+	void sphereSurface(const Sphere &sphere, const Vector &P, const Interface *interface, Surface &s) const;
+	void triangleSurface(const Mesh &mesh, unsigned triangle, const Vector &P, const Vector &direction
+						 , const Interface *interface, Surface &s) const;
+	
+	// Compute sphere_inclusion and the interfaces for the spheres in their current order
+	bool computeSphereInclusion();
+	// Switch the spheres to the dynamic BVH, if they use another accelerator
+	void makeDynamic();
+	
+	std::string sphereToString(const Sphere &sphere) const;
+	std::string meshToString(const Mesh &mesh) const;
+	
+	std::vector<Sphere> spheres;
+	std::vector<int> sphere_keys; // See sphereKey
+	int next_sphere_key = 0;
+	std::vector<Plane> planes;
+	std::vector<Mesh> meshes;
+	std::vector<Material> materials;
+	std::vector<std::string> material_names; // Empty for materials without name
+	std::map<std::string, unsigned short> material_by_name;
 	std::vector<int> sphere_inclusion;
+	std::vector<Interface> interfaces;
+	std::vector<Interface> mesh_interfaces;
+	std::vector<Group> groups;
+	std::map<std::string, int> group_by_name;
+	std::vector<Instance> instances;
+	BVH instance_bvh; // Top level of the two-level structure
+	BVH::Settings bvh_settings;
+	Accelerator sphere_accel = LINEAR_ACCEL;
+	Grid sphere_grid; // Its indices are indices of spheres
+	BVH sphere_bvh; // Same
+	DynamicBVH sphere_dynamic; // Same
+	int dynamic_rebuilds = 0; // Number of times the dynamic BVH was built again because of edits
+	std::vector<int> large_spheres; // Spheres left out of the grid because they would fill too many cells (walls)
+	std::vector<std::vector<Interface> > group_interfaces; // Spheres, then meshes of each group
     Light light;
 };
 
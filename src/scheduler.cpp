@@ -0,0 +1,271 @@
+#include "scheduler.hpp"
+#include "utils.hpp"
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <dirent.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Worker running the current thread, with its scheduler
+static thread_local const Scheduler *current_scheduler = nullptr;
+static thread_local int current_worker = -1;
+
+static int global_thread_count = 0;
+static Scheduler::Affinity global_affinity = Scheduler::NO_AFFINITY;
+
+// CPUs on which the process may run, grouped by NUMA node in the order of the nodes. The topology is read from
+// sysfs, all the CPUs are in a single node if it is not available.
+static std::vector<std::vector<int> > numaNodes() {
+	std::vector<int> allowed;
+#ifdef __linux__
+	cpu_set_t set;
+	if (sched_getaffinity(0, sizeof(set), &set) == 0)
+		for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			if (CPU_ISSET(cpu, &set))
+				allowed.push_back(cpu);
+#endif
+	if (allowed.empty())
+		for (unsigned cpu = 0; cpu < std::max(std::thread::hardware_concurrency(), 1u); cpu++)
+			allowed.push_back(cpu);
+	
+	std::map<int, std::vector<int> > by_node;
+	const std::string sysfs = "/sys/devices/system/node";
+	if (DIR *dir = opendir(sysfs.c_str())) {
+		while (dirent *entry = readdir(dir)) {
+			int node;
+			char end;
+			if (sscanf(entry->d_name, "node%d%c", &node, &end) != 1)
+				continue;
+			// List of ranges of CPUs, such as 0-3,8-11
+			std::ifstream file(sysfs + "/" + entry->d_name + "/cpulist");
+			std::string range;
+			while (getline(file, range, ',')) {
+				int first, last;
+				std::stringstream r(range);
+				if (!(r >> first))
+					continue;
+				last = first;
+				if (r.get() == '-')
+					r >> last;
+				for (int cpu = first; cpu <= last; cpu++)
+					if (std::binary_search(allowed.begin(), allowed.end(), cpu))
+						by_node[node].push_back(cpu);
+			}
+		}
+		closedir(dir);
+	}
+	std::vector<std::vector<int> > nodes;
+	for (std::pair<const int, std::vector<int> > &node : by_node)
+		nodes.push_back(std::move(node.second));
+	if (nodes.empty())
+		nodes.push_back(allowed);
+	return nodes;
+}
+
+Scheduler::Scheduler(int n_threads, Affinity a) : affinity(a), queued(0), stopping(false) {
+	if (n_threads <= 0) {
+		n_threads = 0;
+		for (const std::vector<int> &node : numaNodes())
+			n_threads += node.size();
+	}
+	for (int i = 0; i < n_threads; i++)
+		workers.emplace_back(new Worker());
+	place(affinity);
+	// Workers steal from those of their node first, starting after themselves so that they do not all
+	// try the same victims
+	for (int i = 0; i < n_threads; i++)
+		for (int same = 1; same >= 0; same--)
+			for (int k = 1; k < n_threads; k++) {
+				int victim = (i + k) % n_threads;
+				if ((workers[victim]->node == workers[i]->node) == (bool) same)
+					workers[i]->victims.push_back(victim);
+			}
+	// The workers are started once all the deques exist, since they steal from each other
+	for (int i = 0; i < n_threads; i++)
+		workers[i]->thread = std::thread(&Scheduler::workerLoop, this, i);
+}
+
+Scheduler::~Scheduler() {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stopping = true;
+	}
+	work_available.notify_all();
+	for (std::unique_ptr<Worker> &worker : workers)
+		worker->thread.join();
+}
+
+Scheduler &Scheduler::global() {
+	static Scheduler scheduler(global_thread_count, global_affinity);
+	return scheduler;
+}
+
+void Scheduler::setGlobalThreadCount(int n_threads) {
+	global_thread_count = n_threads;
+}
+
+void Scheduler::setGlobalAffinity(Affinity affinity) {
+	global_affinity = affinity;
+}
+
+void Scheduler::place(Affinity affinity) {
+	if (affinity == NO_AFFINITY)
+		return;
+	std::vector<std::vector<int> > nodes = numaNodes();
+	// CPUs in the order in which they are given to the workers, with their node
+	std::vector<std::pair<int, int> > cpus;
+	if (affinity == COMPACT) {
+		for (unsigned n = 0; n < nodes.size(); n++)
+			for (int cpu : nodes[n])
+				cpus.push_back({cpu, n});
+	}
+	else { // Round robin over the nodes
+		for (unsigned k = 0, added = 1; added > 0; k++) {
+			added = 0;
+			for (unsigned n = 0; n < nodes.size(); n++)
+				if (k < nodes[n].size()) {
+					cpus.push_back({nodes[n][k], n});
+					++added;
+				}
+		}
+	}
+	// When there are more workers than CPUs, they are placed again from the first CPU. The nodes are numbered
+	// in the order of their first worker.
+	std::vector<int> numbers(nodes.size(), -1);
+	n_nodes = 0;
+	for (unsigned i = 0; i < workers.size(); i++) {
+		const std::pair<int, int> &cpu = cpus[i % cpus.size()];
+		if (numbers[cpu.second] < 0)
+			numbers[cpu.second] = n_nodes++;
+		workers[i]->cpu = cpu.first;
+		workers[i]->node = numbers[cpu.second];
+	}
+}
+
+std::string Scheduler::info() const {
+	std::stringstream s;
+	s << workers.size() << " threads";
+	if (affinity != NO_AFFINITY)
+		s << " pinned " << (affinity == COMPACT ? "compactly" : "scattered") << " on " << n_nodes << " NUMA node"
+		  << (n_nodes > 1 ? "s" : "");
+	return s.str();
+}
+
+int Scheduler::currentWorker() const {
+	return (current_scheduler == this) ? current_worker : -1;
+}
+
+void Scheduler::spawn(const std::shared_ptr<Job> &job, std::function<void()> task) {
+	++job->pending;
+	int worker = currentWorker();
+	if (worker >= 0) {
+		std::lock_guard<std::mutex> lock(workers[worker]->mutex);
+		workers[worker]->deques[job->priority].push_back({std::move(task), job});
+	}
+	else {
+		std::lock_guard<std::mutex> lock(shared_mutex);
+		shared[job->priority].push_back({std::move(task), job});
+	}
+	{
+		// Taking the lock makes sure that a worker going to sleep sees the new task
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		++queued;
+	}
+	work_available.notify_one();
+}
+
+bool Scheduler::take(int worker, Task &task, bool steal) {
+	if (queued == 0)
+		return false;
+	for (int p = 0; p < N_PRIORITIES; p++) {
+		// Own deque, newest task first
+		{
+			Worker &own = *workers[worker];
+			std::lock_guard<std::mutex> lock(own.mutex);
+			if (!own.deques[p].empty()) {
+				task = std::move(own.deques[p].back());
+				own.deques[p].pop_back();
+				--queued;
+				return true;
+			}
+		}
+		if (!steal)
+			continue;
+		// Then the tasks submitted from outside, and those of the other workers, oldest first
+		{
+			std::lock_guard<std::mutex> lock(shared_mutex);
+			if (!shared[p].empty()) {
+				task = std::move(shared[p].front());
+				shared[p].pop_front();
+				--queued;
+				return true;
+			}
+		}
+		for (int victim : workers[worker]->victims) {
+			Worker &other = *workers[victim];
+			std::lock_guard<std::mutex> lock(other.mutex);
+			if (!other.deques[p].empty()) {
+				task = std::move(other.deques[p].front());
+				other.deques[p].pop_front();
+				--queued;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+void Scheduler::execute(Task &task) {
+	if (!task.job->cancelled())
+		task.run();
+	if (--task.job->pending == 0) {
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		job_done.notify_all();
+	}
+	task = Task(); // Release the job and the captures of the task
+}
+
+void Scheduler::workerLoop(int index) {
+	current_scheduler = this;
+	current_worker = index;
+#ifdef __linux__
+	// Pinned before running any task, so that the memory first touched by the tasks is allocated on its node
+	if (workers[index]->cpu >= 0) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(workers[index]->cpu, &set);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+			WarningMessage() << "could not pin worker " << index << " to CPU " << workers[index]->cpu;
+	}
+#endif
+	Task task;
+	while (true) {
+		if (take(index, task)) {
+			execute(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		work_available.wait(lock, [&]() {return queued > 0 || stopping;});
+		if (stopping)
+			return;
+	}
+}
+
+void Scheduler::wait(const std::shared_ptr<Job> &job) {
+	int worker = currentWorker();
+	if (worker < 0) {
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		job_done.wait(lock, [&]() {return job->done();});
+		return;
+	}
+	// A worker runs the tasks it spawned, then blocks until the tasks of the job running on other threads are done
+	Task task;
+	while (!job->done() && take(worker, task, false))
+		execute(task);
+	std::unique_lock<std::mutex> lock(sleep_mutex);
+	job_done.wait(lock, [&]() {return job->done();});
+}
@@ -0,0 +1,136 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <algorithm>
+#include <string>
+
+/** Work-stealing scheduler running the parallel work of the program (rendering tiles, BVH builds, encoding)
+	Each worker thread has its own deques of tasks, one per priority. A worker runs the tasks of its own deques
+	last in first out (the most recent ones, whose data is still in its caches), and when they are empty steals
+	the oldest tasks of the other workers, the highest priority being always taken first. Tasks submitted by
+	other threads go to a shared queue.
+	Tasks belong to jobs, which are waited for and cancelled as a whole. Cancellation is cooperative: the tasks
+	of a cancelled job which have not started are skipped, and running ones may poll Job::cancelled().
+	The workers may be pinned to the CPUs of the NUMA nodes of the machine (see Affinity). They then steal from
+	the workers of their own node first, and workerNode tells on which node a task runs, so that it can use data
+	allocated on that node.
+*/
+class Scheduler {
+public:
+	enum Priority : unsigned char {HIGH, NORMAL, LOW};
+	static constexpr int N_PRIORITIES = 3;
+	
+	// Placement of the workers: not pinned (left to the operating system), or each pinned to one CPU, filling the
+	// NUMA nodes one after the other (COMPACT) or spreading the workers over all the nodes (SCATTER)
+	enum Affinity : unsigned char {NO_AFFINITY, COMPACT, SCATTER};
+	
+	class Job {
+	public:
+		Job(Priority p) : priority(p), pending(0), cancel_flag(false) {}
+		
+		void cancel() {cancel_flag = true;}
+		bool cancelled() const {return cancel_flag;}
+		bool done() const {return pending == 0;} // All the tasks spawned so far are finished or skipped
+		
+		const Priority priority;
+		
+	private:
+		friend class Scheduler;
+		std::atomic<long> pending; // Number of tasks not finished yet
+		std::atomic<bool> cancel_flag;
+	};
+	
+	// Start n_threads workers (0 for the number of CPUs the process may run on)
+	Scheduler(int n_threads = 0, Affinity affinity = NO_AFFINITY);
+	~Scheduler();
+	Scheduler(const Scheduler&) = delete;
+	Scheduler &operator=(const Scheduler&) = delete;
+	
+	// Scheduler shared by the whole program, started on first use with the number of threads and the affinity
+	// given before
+	static Scheduler &global();
+	static void setGlobalThreadCount(int n_threads);
+	static void setGlobalAffinity(Affinity affinity);
+	
+	int threadCount() const {return workers.size();}
+	// Index of the worker running the calling thread, -1 if it is not a worker of this scheduler
+	int currentWorker() const;
+	// Number of NUMA nodes on which the workers are pinned (1 if they are not pinned), and node of a worker,
+	// numbered from 0 to nodeCount() - 1 (0 for another thread)
+	int nodeCount() const {return n_nodes;}
+	int workerNode(int worker) const {return worker >= 0 ? workers[worker]->node : 0;}
+	std::string info() const; // Description of the workers and of their placement
+	
+	std::shared_ptr<Job> createJob(Priority priority = NORMAL) {return std::make_shared<Job>(priority);}
+	void spawn(const std::shared_ptr<Job> &job, std::function<void()> task);
+	// Wait for all the tasks of the job. A worker first runs the tasks of its own deques (those it spawned, such as
+	// the tasks of the job), so that tasks can wait for the jobs they spawn, then blocks until the job is done. It
+	// does not steal unrelated tasks, which could delay its return.
+	void wait(const std::shared_ptr<Job> &job);
+	
+	// Run body(first, last) on the ranges of at most grain indices of [begin, end) as tasks of job, and wait
+	// for them. Returns false if the job was cancelled (some ranges may then have been skipped).
+	template <class Body>
+	bool parallelFor(const std::shared_ptr<Job> &job, unsigned begin, unsigned end, unsigned grain, Body body);
+	// Same in a new job of the given priority
+	template <class Body>
+	bool parallelFor(unsigned begin, unsigned end, unsigned grain, Body body, Priority priority = NORMAL) {
+		return parallelFor(createJob(priority), begin, end, grain, body);
+	}
+	
+private:
+	struct Task {
+		std::function<void()> run;
+		std::shared_ptr<Job> job;
+	};
+	
+	struct Worker {
+		std::thread thread;
+		std::mutex mutex; // Protects the deques
+		std::deque<Task> deques[N_PRIORITIES];
+		int cpu = -1; // CPU on which the worker is pinned, -1 if it is not
+		int node = 0;
+		std::vector<int> victims; // Other workers, those of the same node first
+	};
+	
+	// Choose the CPUs of the workers according to affinity
+	void place(Affinity affinity);
+	
+	void workerLoop(int index);
+	// Take the next task for the given worker, returns false if there is none. Unless steal, only the tasks of its
+	// own deques are taken.
+	bool take(int worker, Task &task, bool steal = true);
+	// Run a task and signal the end of its job
+	void execute(Task &task);
+	
+	std::vector<std::unique_ptr<Worker> > workers;
+	int n_nodes = 1;
+	Affinity affinity;
+	std::mutex shared_mutex; // Protects the shared queues
+	std::deque<Task> shared[N_PRIORITIES];
+	std::atomic<long> queued; // Number of tasks waiting in the deques and queues
+	std::atomic<bool> stopping;
+	std::mutex sleep_mutex; // For the idle workers and the threads waiting for a job
+	std::condition_variable work_available, job_done;
+};
+
+template <class Body>
+bool Scheduler::parallelFor(const std::shared_ptr<Job> &job, unsigned begin, unsigned end, unsigned grain, Body body) {
+	grain = std::max(grain, (unsigned) 1);
+	for (unsigned first = begin; first < end; first += std::min(grain, end - first)) {
+		unsigned last = first + std::min(grain, end - first);
+		spawn(job, [=]() {body(first, last);});
+	}
+	wait(job);
+	return !job->cancelled();
+}
+
+#endif
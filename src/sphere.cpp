@@ -1,36 +1,42 @@
 #include <math.h>
 #include "sphere.hpp"
 
-bool Sphere::compareByRadius(const std::unique_ptr<Sphere> &s1, const std::unique_ptr<Sphere> &s2) {
-	return (s1->radius > s2->radius);
+bool Sphere::compareByRadius(const Sphere &s1, const Sphere &s2) {
+	return (s1.radius > s2.radius);
 }
 
 Sphere::Intersection Sphere::intersect(const Ray &ray) const {
-	double b = 2. * ray.direction.sp(ray.origin - origin);
-	double c = (ray.origin - origin).snorm() - radius * radius;
+	Vector oc = ray.origin - origin;
+	real b = ray.direction.sp(oc); // Half of the usual b coefficient, the direction being normalized
+	real c = (oc.snorm() - radius * radius);
 	
-	double delta = b*b - 4.*c;
+	real delta = b*b - c;
 	if (delta < 0)
 		return Sphere::Intersection(0, false);
 	
-	double t1 = (-b - sqrt(delta))/2.;
+	// Numerically stable form of the roots: avoid the cancellation of -b + sqrt(delta)
+	real q = (b > 0) ? -b - sqrt(delta) : -b + sqrt(delta);
+	real t1 = q, t2 = (q != 0) ? c / q : 0;
+	if (t1 > t2)
+		std::swap(t1, t2);
+	
 	if (t1 > 0)
 		return Sphere::Intersection(t1, true);
 	
-	double t2 = (-b + sqrt(delta))/2.;
 	if (t2 > 0)
 		return Sphere::Intersection(t2, false);
 	
 	return Sphere::Intersection(0, false);
 }
 
-Vector Sphere::color(Vector P) const {
-	return material.color;
+Vector Sphere::reproject(const Vector &P) const {
+	Vector d = P - origin;
+	return origin + (radius / d.norm()) * d;
 }
 
 // An example of coordinate-dependent sphere color
-Vector MultiColorSphere::color(Vector P) const {
-	double r=0,g=0,b=0;
+Vector Sphere::multiColor(const Vector &P) const {
+	real r=0,g=0,b=0;
 	if (origin.x - P.x > 0.)
 		r = 1;
 	if (origin.y - P.y > 0.)
@@ -4,37 +4,60 @@
 #include "vector.hpp"
 #include "ray.hpp"
 #include "material.hpp"
+#include "utils.hpp"
 #include <utility>
-#include <memory>
 
+/** Plain sphere stored by value in the scene
+	The way the color of a point is computed is selected by a texture ID instead of virtual dispatch,
+	so that shading can be inlined and spheres can be kept contiguously in memory. The material is
+	an index in the material table of the scene.
+*/
 class Sphere {
 public:
+	// Procedural textures. To add a new one, add its ID here and its case in color().
+	enum Texture : unsigned char {
+		UNIFORM, // Color of the material
+		MULTICOLOR // Color depending on the octant of the point with respect to the origin
+	};
+	
 	/* Constructors */
-	Sphere() : origin(), radius(0) {}
-	Sphere(Vector o, double r) : origin(o), radius(r) {}
-	Sphere(Vector o, double r, Material m) : origin(o), radius(r), material(m) {}
+	Sphere() : origin(), radius(0), material(0), texture(UNIFORM) {}
+	Sphere(Vector o, real r, unsigned short m = 0, Texture tex = UNIFORM) : origin(o), radius(r), material(m), texture(tex) {}
 	
-	typedef std::pair<double, bool> Intersection;
+	typedef std::pair<real, bool> Intersection;
 	
-	static bool compareByRadius(const std::unique_ptr<Sphere> &s1, const std::unique_ptr<Sphere> &s2);
+	static bool compareByRadius(const Sphere &s1, const Sphere &s2);
 	
 	// Returns 0 if no intersection and t such that C + t.V is the intersection otherwise.
 	// If t > 0 then returns also true if the ray is entering the sphere
 	Intersection intersect(const Ray &ray) const;
+	
+	// Project a computed intersection point back onto the surface, which removes the error
+	// accumulated by C + t.V when t itself is inaccurate
+	Vector reproject(const Vector &P) const;
+	
+	// Conservative bound on the distance between a reprojected point and the exact surface, and on the
+	// error of the intersection test for rays starting close to the surface. Spawned rays are offset
+	// by this amount along the normal so that they cannot hit the surface they leave.
+	real errorBound() const {return errorGamma(8) * (origin.maxAbs() + radius);}
 
-	virtual Vector color(Vector P) const; // Return the color of a point on the sphere, by default the color of the material
+	// Return the color of a point on the sphere according to its texture (mat is the material of the sphere)
+	Vector color(const Vector &P, const Material &mat) const {
+		switch (texture) {
+		case MULTICOLOR:
+			return multiColor(P);
+		default:
+			return mat.color;
+		}
+	}
 	
 	Vector origin;
-	double radius;
-	Material material;
-};
-
-// Example of other type of sphere for which the color is not uniform on the sphere
-class MultiColorSphere : public Sphere {
-public:
-	MultiColorSphere(Vector o, double r) : Sphere(o, r) {}
+	real radius;
+	unsigned short material; // Index in the material table of the scene
+	Texture texture;
 	
-	virtual Vector color(Vector P) const;
+private:
+	Vector multiColor(const Vector &P) const;
 };
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef TRANSFORM_HPP
+#define TRANSFORM_HPP
+
+#include "vector.hpp"
+#include "ray.hpp"
+#include "bbox.hpp"
+#include "utils.hpp"
+#include <math.h>
+
+/** Similarity transform: rotation, then uniform scaling, then translation
+	Being a similarity, it maps spheres to spheres and keeps the angles, so normals are simply rotated.
+*/
+class Transform {
+public:
+	/* Constructors */
+	Transform() : row0(1,0,0), row1(0,1,0), row2(0,0,1), scale(1), translation() {}
+	// Rotation by the angles rx, ry and rz (in degrees) around the x, y and z axes (in this order)
+	Transform(const Vector &t, real s, real rx = 0, real ry = 0, real rz = 0) : scale(s), translation(t) {
+		real a = rx * PI / 180, b = ry * PI / 180, c = rz * PI / 180;
+		// Rows of Rz.Ry.Rx
+		row0 = Vector(cos(c)*cos(b), cos(c)*sin(b)*sin(a) - sin(c)*cos(a), cos(c)*sin(b)*cos(a) + sin(c)*sin(a));
+		row1 = Vector(sin(c)*cos(b), sin(c)*sin(b)*sin(a) + cos(c)*cos(a), sin(c)*sin(b)*cos(a) - cos(c)*sin(a));
+		row2 = Vector(-sin(b), cos(b)*sin(a), cos(b)*cos(a));
+	}
+	
+	Vector rotate(const Vector &v) const {return Vector(row0.sp(v), row1.sp(v), row2.sp(v));}
+	Vector rotateBack(const Vector &v) const {return v.x * row0 + v.y * row1 + v.z * row2;} // Inverse rotation
+	
+	Vector point(const Vector &P) const {return translation + scale * rotate(P);} // Object to world coordinates
+	Vector pointBack(const Vector &P) const {return (1 / scale) * rotateBack(P - translation);} // World to object
+	
+	// Ray in object coordinates corresponding to a ray in world coordinates. The direction stays normalized,
+	// so distances along the object ray are the world distances divided by scale.
+	Ray rayBack(const Ray &ray) const {return Ray(pointBack(ray.origin), rotateBack(ray.direction));}
+	
+	// Bounding box in world coordinates of a box in object coordinates
+	BBox box(const BBox &b) const {
+		BBox res;
+		for (int i = 0; i < 8; i++)
+			res.extend(point(Vector((i & 1) ? b.max.x : b.min.x, (i & 2) ? b.max.y : b.min.y, (i & 4) ? b.max.z : b.min.z)));
+		// Enlarge it by the rounding error of the transformation
+		real err = errorGamma(8) * (res.min.maxAbs() + res.max.maxAbs());
+		return BBox(res.min - Vector(err, err, err), res.max + Vector(err, err, err));
+	}
+	
+	Vector row0, row1, row2; // Rows of the rotation matrix
+	real scale;
+	Vector translation;
+};
+
+#endif
@@ -3,10 +3,18 @@
 
 #include <string>
 #include <iostream>
+#include <limits>
 #include "rlutil.hpp"
+#include "vector.hpp"
 
 constexpr double PI = 3.141592653589793238463;
 
+// Bound on the relative rounding error accumulated by n floating point operations in precision real,
+// following the gamma_n notation of Higham (Accuracy and Stability of Numerical Algorithms)
+constexpr real errorGamma(int n) {
+	return (n * std::numeric_limits<real>::epsilon() * 0.5) / (1 - n * std::numeric_limits<real>::epsilon() * 0.5);
+}
+
 /* Custom class for printing error messages using the rlutil library */
 class ErrorMessage {
 public:
@@ -1,6 +1,8 @@
 #include "vector.hpp"
 #include "utils.hpp"
 #include <math.h>
+#include <cmath>
+#include <algorithm>
 #include <random>
 
 /* Random generators */
@@ -9,61 +11,77 @@ std::mt19937 mt(rd());
 std::uniform_real_distribution<double> unif(0.,1.);
 
 /* Operations */
-Vector Vector::operator*(const double &alpha) const {
-	return Vector(alpha*x, alpha*y, alpha*z);
+template <typename T>
+VectorT<T> VectorT<T>::operator*(const T &alpha) const {
+	return VectorT(alpha*x, alpha*y, alpha*z);
 }
 
-Vector Vector::operator*(const Vector &v) const {
-	return Vector(x*v.x,y*v.y,z*v.z);
+template <typename T>
+VectorT<T> VectorT<T>::operator*(const VectorT &v) const {
+	return VectorT(x*v.x,y*v.y,z*v.z);
 }
 	
-Vector Vector::operator+(const Vector &v) const {
-	return Vector(x+v.x, y+v.y, z+v.z);
+template <typename T>
+VectorT<T> VectorT<T>::operator+(const VectorT &v) const {
+	return VectorT(x+v.x, y+v.y, z+v.z);
 }
 	
-Vector Vector::operator-(const Vector &v) const {
-	return Vector(x-v.x, y-v.y, z-v.z);
+template <typename T>
+VectorT<T> VectorT<T>::operator-(const VectorT &v) const {
+	return VectorT(x-v.x, y-v.y, z-v.z);
 }
 	
-Vector Vector::operator-() const {
-	return Vector(-x,-y,-z);
+template <typename T>
+VectorT<T> VectorT<T>::operator-() const {
+	return VectorT(-x,-y,-z);
 }
 
-double Vector::sp(const Vector &v) const {
+template <typename T>
+T VectorT<T>::sp(const VectorT &v) const {
 	return (x*v.x + y*v.y + z*v.z);
 }
 
-Vector Vector::vp(const Vector &v) const {
-	return Vector(y*v.z - z*v.y, z*v.x - x*v.z, x*v.y - y*v.x);
+template <typename T>
+VectorT<T> VectorT<T>::vp(const VectorT &v) const {
+	return VectorT(y*v.z - z*v.y, z*v.x - x*v.z, x*v.y - y*v.x);
 }
 
-double Vector::snorm() const {
+template <typename T>
+T VectorT<T>::snorm() const {
 	return x*x + y*y + z*z;
 }
 
-double Vector::norm() const {
+template <typename T>
+T VectorT<T>::norm() const {
 	return sqrt(snorm());
 }
 
-Vector Vector::normalize() const {
-	double n = norm();
-	return Vector(x/n, y/n, z/n);
+template <typename T>
+T VectorT<T>::maxAbs() const {
+	return std::max(std::fabs(x), std::max(std::fabs(y), std::fabs(z)));
 }
 
-void Vector::convertCoordinateSystem(Vector u, Vector v, Vector w) {
+template <typename T>
+VectorT<T> VectorT<T>::normalize() const {
+	T n = norm();
+	return VectorT(x/n, y/n, z/n);
+}
+
+template <typename T>
+void VectorT<T>::convertCoordinateSystem(VectorT u, VectorT v, VectorT w) {
 	x = x*u.x + y*v.x + z*w.x;
 	y = x*u.y + y*v.y + z*w.y;
 	z = x*u.z + y*v.z + z*w.z;
 }
 
-Vector operator*(double alpha, const Vector &v) {
-	return Vector(alpha*v.x, alpha*v.y, alpha*v.z);
-}
+// Both precisions are instantiated so that they can be mixed (e.g. for comparisons)
+template class VectorT<float>;
+template class VectorT<double>;
 
 Vector generateUniformRandomVector() {
-	double r1 = unif(mt);
-	double r2 = unif(mt);
-	double t = sqrt(1-r2);
+	real r1 = unif(mt);
+	real r2 = unif(mt);
+	real t = sqrt(1-r2);
 	
 	return Vector(cos(2*PI*r1)*t, sin(2*PI*r1)*t, sqrt(r2));
 }
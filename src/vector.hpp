@@ -1,37 +1,53 @@
 #ifndef VECTOR_HPP
 #define VECTOR_HPP
 
-class Vector {
+// Scalar type of the geometry (coordinates, radii, material coefficients...).
+// Building with RAYTRACER_SINGLE_PRECISION defined gives the float32 renderer.
+#ifdef RAYTRACER_SINGLE_PRECISION
+typedef float real;
+#else
+typedef double real;
+#endif
+
+template <typename T>
+class VectorT {
 public:
 	/* Constructors */
-	Vector() : x(0), y(0), z(0) {}
-	Vector(double x1, double y1, double z1) : x(x1), y(y1), z(z1) {}
+	VectorT() : x(0), y(0), z(0) {}
+	VectorT(T x1, T y1, T z1) : x(x1), y(y1), z(z1) {}
 	
 	/* Operations */
-	Vector operator*(const double &alpha) const; // Product by a constant
-	Vector operator*(const Vector &v) const; // Coordinate product
-	Vector operator+(const Vector &v) const;
-	Vector operator-(const Vector &v) const;	
-	Vector operator-() const;
-	bool operator==(const Vector &v) const {
+	VectorT operator*(const T &alpha) const; // Product by a constant
+	VectorT operator*(const VectorT &v) const; // Coordinate product
+	VectorT operator+(const VectorT &v) const;
+	VectorT operator-(const VectorT &v) const;	
+	VectorT operator-() const;
+	T operator[](int i) const {return (&x)[i];} // i-th coordinate
+	bool operator==(const VectorT &v) const {
 		return (v.x == x && v.y == y && v.z == z);
 	}
+	
+	// Reflexive version (to multiply by a constant on the right)
+	friend VectorT operator*(T alpha, const VectorT &v) {
+		return VectorT(alpha*v.x, alpha*v.y, alpha*v.z);
+	}
 
-	double sp(const Vector &v) const; // Scalar product
-	Vector vp(const Vector &v) const; // Vector product
-	double snorm() const; // Square of the norm
-	double norm() const;
-	Vector normalize() const; // Return the normalized vector
+	T sp(const VectorT &v) const; // Scalar product
+	VectorT vp(const VectorT &v) const; // Vector product
+	T snorm() const; // Square of the norm
+	T norm() const;
+	T maxAbs() const; // Largest absolute value of the coordinates
+	VectorT normalize() const; // Return the normalized vector
 	
 	// Convert the current vector written in a coordinate system expressed in the
 	// canonical system to the canonical system
-	void convertCoordinateSystem(Vector u, Vector v, Vector w);
+	void convertCoordinateSystem(VectorT u, VectorT v, VectorT w);
 	
 	/* Coordinates */
-	double x,y,z;
+	T x,y,z;
 };
 
-Vector operator*(double alpha, const Vector &v); // Reflexive version (to multiply by a constant on the right)
+typedef VectorT<real> Vector;
 
 Vector generateUniformRandomVector(); // Returns a uniform random vector in the unit half-sphere
 double getUniformNumber(); // Returns a random vector between 0 and 1
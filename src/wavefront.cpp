@@ -0,0 +1,399 @@
+#include "wavefront.hpp"
+#include "utils.hpp"
+#include "bbox.hpp"
+#include <algorithm>
+#include <utility>
+#include <cmath>
+
+// Number of camera rays traced together. The queues grow with the branching of the ray trees, so the batches are
+// bounded to keep them in the caches (and their memory bounded in deterministic mode, where trees are wide).
+constexpr int BATCH_SIZE = 4096;
+
+// Number of bits of the cells of the origins along each axis, for binning. With the direction octants, the paths
+// are sorted into 8^3 * 8 bins.
+constexpr int BIN_BITS = 3;
+
+// The shadow rays of a packet are traced together only if the extent of their origins is at most this fraction of
+// their distance to the light, so that they form a thin frustum. Otherwise they traverse different parts of the
+// scene, and are faster one by one.
+constexpr real SHADOW_PACKET_SPREAD = 0.1;
+
+void Wavefront::PathQueue::clear() {
+	resize(0);
+}
+
+void Wavefront::PathQueue::resize(unsigned n) {
+	for (std::vector<real> *v : {&ox, &oy, &oz, &dx, &dy, &dz, &tr, &tg, &tb, &weight})
+		v->resize(n);
+	depth.resize(n);
+	sample.resize(n);
+}
+
+void Wavefront::PathQueue::push(const Vector &origin, const Vector &direction, const Vector &throughput, real w, int d, int s) {
+	ox.push_back(origin.x); oy.push_back(origin.y); oz.push_back(origin.z);
+	dx.push_back(direction.x); dy.push_back(direction.y); dz.push_back(direction.z);
+	tr.push_back(throughput.x); tg.push_back(throughput.y); tb.push_back(throughput.z);
+	weight.push_back(w);
+	depth.push_back(d);
+	sample.push_back(s);
+}
+
+void Wavefront::ShadowQueue::clear() {
+	for (std::vector<real> *v : {&px, &py, &pz, &nx, &ny, &nz, &eps, &fr, &fg, &fb})
+		v->clear();
+	sample.clear();
+}
+
+void Wavefront::ShadowQueue::push(const Vector &P, const Vector &normal, real e, const Vector &factor, int s) {
+	px.push_back(P.x); py.push_back(P.y); pz.push_back(P.z);
+	nx.push_back(normal.x); ny.push_back(normal.y); nz.push_back(normal.z);
+	eps.push_back(e);
+	fr.push_back(factor.x); fg.push_back(factor.y); fb.push_back(factor.z);
+	sample.push_back(s);
+}
+
+void Wavefront::render(const Scene &scene, const std::vector<Ray> &rays, int samples, bool same_rays, Vector *colors, Stats &stats
+					   , const SphereRaster *raster) {
+	int n_pixels = same_rays ? rays.size() : rays.size() / samples;
+	int n_camera = n_pixels * samples;
+	cr.assign(n_camera, 0);
+	cg.assign(n_camera, 0);
+	cb.assign(n_camera, 0);
+	budgets.assign(n_camera, Scene::RayBudget(settings.prune_weight, settings.max_rays));
+	for (int first = 0; first < n_camera; first += BATCH_SIZE) {
+		generate(rays, samples, same_rays, first, std::min(first + BATCH_SIZE, n_camera));
+		for (bool primary = true; paths.size() > 0; primary = false) {
+			if (!primary && settings.bin)
+				bin();
+			extend(scene, primary, (primary && same_rays) ? samples : 1, primary ? raster : nullptr);
+			shade(scene);
+			shadow(scene);
+			accumulate();
+			std::swap(paths, next);
+		}
+	}
+	
+	// Sum of the samples of each pixel
+	for (int p = 0; p < n_pixels; p++) {
+		Vector color(0, 0, 0);
+		for (int s = p * samples; s < (p + 1) * samples; s++)
+			color = color + Vector(cr[s], cg[s], cb[s]);
+		colors[p] = color;
+	}
+	if (settings.deterministic)
+		for (const Scene::RayBudget &budget : budgets) {
+			stats.traced += budget.rays;
+			stats.pruned_weight += budget.pruned_weight;
+			stats.pruned_cap += budget.pruned_cap;
+		}
+}
+
+void Wavefront::generate(const std::vector<Ray> &rays, int samples, bool same_rays, int first, int last) {
+	paths.resize(last - first);
+	for (int k = 0; k < last - first; k++) {
+		const Ray &ray = rays[same_rays ? (first + k) / samples : first + k];
+		paths.ox[k] = ray.origin.x; paths.oy[k] = ray.origin.y; paths.oz[k] = ray.origin.z;
+		paths.dx[k] = ray.direction.x; paths.dy[k] = ray.direction.y; paths.dz[k] = ray.direction.z;
+		paths.tr[k] = paths.tg[k] = paths.tb[k] = 1;
+		paths.weight[k] = 1;
+		paths.depth[k] = settings.bounces;
+		paths.sample[k] = first + k;
+	}
+}
+
+// Spread the BIN_BITS lower bits of v, with two zero bits between consecutive bits
+static unsigned spreadBinBits(unsigned v) {
+	unsigned spread = 0;
+	for (int b = 0; b < BIN_BITS; b++)
+		spread |= ((v >> b) & 1) << (3 * b);
+	return spread;
+}
+
+// Reorder the elements of v by order
+template <class T>
+static void permute(std::vector<T> &v, const std::vector<unsigned> &order, std::vector<T> &tmp) {
+	tmp.resize(v.size());
+	for (unsigned k = 0; k < v.size(); k++)
+		tmp[k] = v[order[k]];
+	v.swap(tmp);
+}
+
+void Wavefront::bin() {
+	unsigned n = paths.size();
+	// Bins: cell of the origin in the bounds of the origins, in Morton order, then octant of the direction
+	real min[3], max[3];
+	const std::vector<real> *origin[3] = {&paths.ox, &paths.oy, &paths.oz};
+	real scale[3];
+	for (int a = 0; a < 3; a++) {
+		const std::vector<real> &o = *origin[a];
+		min[a] = *std::min_element(o.begin(), o.end());
+		max[a] = *std::max_element(o.begin(), o.end());
+		scale[a] = max[a] > min[a] ? ((1 << BIN_BITS) - 0.5) / (max[a] - min[a]) : 0;
+	}
+	bins.resize(n);
+	for (unsigned k = 0; k < n; k++) {
+		unsigned octant = (paths.dx[k] < 0) << 2 | (paths.dy[k] < 0) << 1 | (paths.dz[k] < 0);
+		unsigned cell = spreadBinBits((paths.ox[k] - min[0]) * scale[0]) << 2 | spreadBinBits((paths.oy[k] - min[1]) * scale[1]) << 1
+						| spreadBinBits((paths.oz[k] - min[2]) * scale[2]);
+		bins[k] = cell << 3 | octant;
+	}
+	
+	// Counting sort of the paths by bin
+	std::vector<unsigned> offset(8 << (3 * BIN_BITS), 0);
+	for (unsigned k = 0; k < n; k++)
+		++offset[bins[k]];
+	unsigned sum = 0;
+	for (unsigned &o : offset) {
+		unsigned c = o;
+		o = sum;
+		sum += c;
+	}
+	order.resize(n);
+	for (unsigned k = 0; k < n; k++)
+		order[offset[bins[k]]++] = k;
+	std::vector<real> tmp;
+	for (std::vector<real> *v : {&paths.ox, &paths.oy, &paths.oz, &paths.dx, &paths.dy, &paths.dz, &paths.tr, &paths.tg, &paths.tb, &paths.weight})
+		permute(*v, order, tmp);
+	std::vector<int> tmp_int;
+	permute(paths.depth, order, tmp_int);
+	permute(paths.sample, order, tmp_int);
+}
+
+void Wavefront::extend(const Scene &scene, bool primary, int shared_samples, const SphereRaster *raster) {
+	unsigned n = paths.size();
+	hits.resize(n);
+	// The samples which share their camera ray share its closest hit
+	auto shared = [&](unsigned k) {return shared_samples > 1 && k > 0 && paths.sample[k] % shared_samples != 0;};
+	if (raster) {
+		for (unsigned k = 0; k < n; k++)
+			hits[k] = shared(k) ? hits[k - 1] : scene.intersect(paths.ray(k), *raster);
+		return;
+	}
+	if (!primary || !settings.packets) {
+		for (unsigned k = 0; k < n; k++)
+			hits[k] = shared(k) ? hits[k - 1] : scene.intersect(paths.ray(k));
+		return;
+	}
+	// The camera rays of neighbouring pixels (or samples of a pixel) are traced by packets
+	Ray rays[Scene::PACKET_SIZE];
+	unsigned indices[Scene::PACKET_SIZE];
+	Scene::Intersection packet_hits[Scene::PACKET_SIZE];
+	int count = 0;
+	auto trace = [&]() {
+		scene.intersectPacket(rays, count, packet_hits);
+		for (int j = 0; j < count; j++)
+			hits[indices[j]] = packet_hits[j];
+		count = 0;
+	};
+	for (unsigned k = 0; k < n; k++) {
+		if (shared(k))
+			continue;
+		rays[count] = paths.ray(k);
+		indices[count++] = k;
+		if (count == Scene::PACKET_SIZE)
+			trace();
+	}
+	if (count > 0)
+		trace();
+	for (unsigned k = 0; k < n; k++)
+		if (shared(k))
+			hits[k] = hits[k - 1];
+}
+
+void Wavefront::shade(const Scene &scene) {
+	unsigned n = paths.size();
+	surfaces.resize(n);
+	kinds.resize(n);
+	order.resize(n);
+	unsigned count[N_KINDS + 1] = {0};
+	for (unsigned k = 0; k < n; k++) {
+		if (hits[k].t > 0) {
+			surfaces[k] = scene.surface(paths.ray(k), hits[k]);
+			kinds[k] = kind(*surfaces[k].mat);
+		}
+		else
+			kinds[k] = N_KINDS;
+		++count[kinds[k]];
+	}
+	// Counting sort of the hits by kind, the paths which hit nothing being last
+	unsigned offset[N_KINDS + 1] = {0};
+	for (int c = 1; c <= N_KINDS; c++)
+		offset[c] = offset[c - 1] + count[c - 1];
+	for (unsigned k = 0; k < n; k++)
+		order[offset[kinds[k]]++] = k;
+	
+	next.clear();
+	shadows.clear();
+	const unsigned *begin = order.data();
+	shadeKind<DIFFUSE>(scene, begin, count[DIFFUSE]);
+	begin += count[DIFFUSE];
+	shadeKind<REFLECTIVE>(scene, begin, count[REFLECTIVE]);
+	begin += count[REFLECTIVE];
+	shadeKind<REFRACTIVE>(scene, begin, count[REFRACTIVE]);
+}
+
+// Same computations as Scene::getColor, the colors of the spawned rays being replaced by the rays themselves in the
+// queue of the next depth, and the direct lighting by a shadow ray. The branches of the other kinds of materials
+// are removed at compile time.
+template <Wavefront::MaterialKind KIND>
+void Wavefront::shadeKind(const Scene &scene, const unsigned *order, unsigned count) {
+	for (unsigned q = 0; q < count; q++) {
+		unsigned k = order[q];
+		const Scene::Intersection &inter = hits[k];
+		const Scene::Surface &surf = surfaces[k];
+		const Material &mat = *surf.mat;
+		const Vector &P = surf.P;
+		const Vector &nor = surf.nor;
+		Vector inc(paths.dx[k], paths.dy[k], paths.dz[k]);
+		Vector throughput(paths.tr[k], paths.tg[k], paths.tb[k]);
+		real weight = paths.weight[k];
+		int n = paths.depth[k];
+		int sample = paths.sample[k];
+		Scene::RayBudget *budget = settings.deterministic ? &budgets[sample] : nullptr;
+		Vector P1 = P + surf.eps * nor;
+		Vector P2 = P - surf.eps * nor;
+		
+		real specularity = mat.specularity;
+		real refraction = mat.refraction;
+		const Scene::Interface &interface = *surf.interface;
+		if (KIND == REFRACTIVE) {
+			// Fresnel coefficients
+			if (settings.fresnel && !interface.matched && mat.specularity <= 0.) {
+				real k0 = interface.k0;
+				real l = nor.sp(inc);
+				if (l < 0.)
+					l = -l;
+				real m = 1 - l;
+				real m2 = m * m;
+				refraction = 1.-(k0 + (1.-k0) * m2 * m2 * m);
+				specularity = 1. - refraction;
+			}
+			// Random choice between bouncing and refraction
+			if (!settings.deterministic && refraction > 0 && specularity > 0) {
+				if (getUniformNumber() < refraction) {
+					specularity = 0.;
+					refraction = 1.;
+				}
+				else {
+					specularity = 1.;
+					refraction = 0.;
+				}
+			}
+		}
+		
+		// Reflected ray
+		bool reflect = KIND != DIFFUSE && inter.entrance && specularity > 0 && n > 0
+					   && Scene::RayBudget::take(budget, weight * specularity * mat.spec_color.maxAbs());
+		Vector reflected;
+		if (KIND != DIFFUSE)
+			reflected = (inc - 2 * inc.sp(nor) * nor).normalize();
+		
+		// Refracted ray, whose coefficients are applied at the entrance of the sphere only
+		real w_refr = inter.entrance ? weight * refraction * mat.refr_color.maxAbs() : weight;
+		if (KIND == REFRACTIVE && refraction > 0. && n > 0 && Scene::RayBudget::take(budget, w_refr)) {
+			real eta = inter.entrance ? interface.eta_enter : interface.eta_exit;
+			Vector nor_refl = inter.entrance ? nor : -nor;
+			real cos_inc = inc.sp(nor_refl);
+			real norm_coeff = 1 - eta * eta * (1 - cos_inc * cos_inc);
+			if (norm_coeff >= 0)
+				next.push(inter.entrance ? P2 : P1, (eta * inc - (eta * cos_inc + sqrt(norm_coeff)) * nor_refl).normalize()
+						  , inter.entrance ? refraction * (throughput * mat.refr_color) : throughput, w_refr, n - 1, sample);
+			else {
+				// Total reflection, whose color replaces the one of the reflected ray in getColor
+				reflect = false;
+				next.push(inter.entrance ? P1 : P2, reflected, refraction * (throughput * mat.refr_color)
+						  , weight * refraction * mat.refr_color.maxAbs(), n - 1, sample);
+			}
+		}
+		if (reflect)
+			next.push(P1, reflected, specularity * (throughput * mat.spec_color), weight * specularity * mat.spec_color.maxAbs()
+					  , n - 1, sample);
+		
+		// Diffuse part: direct lighting, computed by the shadow stage, and indirect lighting
+		if (inter.entrance && specularity + refraction < 1) {
+			shadows.push(P, nor, surf.eps, (1 - specularity - refraction) * (throughput * surf.color), sample);
+			real w_diff = weight * (1./PI) * mat.diffusion_coeff * surf.color.maxAbs();
+			if (settings.diffuse && n > 0 && Scene::RayBudget::take(budget, w_diff)) {
+				Vector direction = generateUniformRandomVector();
+				// Local coordinate system in which the direction is taken
+				Vector v = Vector(-nor.y, nor.x, 0).normalize();
+				Vector w = nor.vp(v);
+				direction.convertCoordinateSystem(v, w, nor);
+				next.push(P1, direction.normalize(), (1./PI) * mat.diffusion_coeff * (throughput * surf.color), w_diff, n - 1, sample);
+			}
+		}
+	}
+}
+
+void Wavefront::shadow(const Scene &scene) {
+	unsigned n = shadows.size();
+	const Vector light = scene.light.position;
+	const real intensity = scene.light.intensity;
+	ShadowQueue &s = shadows;
+	s.lr.resize(n);
+	s.lg.resize(n);
+	s.lb.resize(n);
+	visible.resize(n);
+	
+	// Light received at each point
+	#pragma omp simd
+	for (unsigned k = 0; k < n; k++) {
+		real x = light.x - s.px[k], y = light.y - s.py[k], z = light.z - s.pz[k];
+		real d2 = x*x + y*y + z*z;
+		real d = sqrt(d2);
+		real c = std::max((real) 0, (x/d * s.nx[k] + y/d * s.ny[k] + z/d * s.nz[k]) * intensity / d2);
+		s.lr[k] = c * s.fr[k];
+		s.lg[k] = c * s.fg[k];
+		s.lb[k] = c * s.fb[k];
+	}
+	
+	// Visibility of the light from the offset points, for the points which receive some. The shadow rays of
+	// neighbouring points converge to the light, so they are traced by packets (in which the obstacles beyond the
+	// light are not searched) when their origins are close enough.
+	const int packet_size = settings.packets ? Scene::PACKET_SIZE : 1;
+	Ray rays[Scene::PACKET_SIZE];
+	real dist[Scene::PACKET_SIZE], t_limits[Scene::PACKET_SIZE];
+	unsigned indices[Scene::PACKET_SIZE];
+	Scene::Intersection obstacles[Scene::PACKET_SIZE];
+	int count = 0;
+	auto trace = [&]() {
+		BBox origins;
+		real nearest = dist[0];
+		for (int j = 0; j < count; j++) {
+			origins.extend(rays[j].origin);
+			nearest = std::min(nearest, dist[j]);
+		}
+		if (settings.packets && (origins.max - origins.min).norm() <= SHADOW_PACKET_SPREAD * nearest)
+			scene.intersectPacket(rays, count, obstacles, t_limits);
+		else
+			for (int j = 0; j < count; j++)
+				obstacles[j] = scene.intersect(rays[j]);
+		for (int j = 0; j < count; j++)
+			visible[indices[j]] = obstacles[j].t <= 0 || obstacles[j].t > dist[j];
+		count = 0;
+	};
+	for (unsigned k = 0; k < n; k++) {
+		visible[k] = false;
+		if (s.lr[k] == 0 && s.lg[k] == 0 && s.lb[k] == 0)
+			continue;
+		Vector P1 = Vector(s.px[k], s.py[k], s.pz[k]) + s.eps[k] * Vector(s.nx[k], s.ny[k], s.nz[k]);
+		rays[count] = Ray(P1, (light - P1).normalize());
+		dist[count] = (light - P1).norm();
+		t_limits[count] = std::nextafter(dist[count], std::numeric_limits<real>::infinity());
+		indices[count++] = k;
+		if (count == packet_size)
+			trace();
+	}
+	if (count > 0)
+		trace();
+}
+
+void Wavefront::accumulate() {
+	for (unsigned k = 0; k < shadows.size(); k++)
+		if (visible[k]) {
+			int sample = shadows.sample[k];
+			cr[sample] += shadows.lr[k];
+			cg[sample] += shadows.lg[k];
+			cb[sample] += shadows.lb[k];
+		}
+}
@@ -0,0 +1,108 @@
+#ifndef WAVEFRONT_HPP
+#define WAVEFRONT_HPP
+
+#include "scene.hpp"
+#include "material.hpp"
+#include "ray.hpp"
+#include "vector.hpp"
+#include <vector>
+
+/** Wavefront integrator: computes the colors of Scene::getColor for a batch of camera rays at once
+	Instead of following the ray tree of one camera ray depth first, the rays of all the trees which are at the
+	same depth are kept in queues stored as structures of arrays, and processed by stages, each one a loop over
+	a whole queue:
+	  - generate: the camera rays become the paths of depth 0
+	  - bin (optional, from depth 1): the paths are reordered by cell of their origin, along a Morton curve, then
+	    by direction octant, so that consecutive rays traverse the same parts of the scene
+	  - extend: closest hit of each path, by packets of neighbouring rays for the camera rays
+	  - shade: surface at each hit, then the reflected, refracted and diffuse rays of the next depth and the shadow
+	    rays. The hits are first grouped by kind of material, so that each loop follows a single code path.
+	  - shadow: direct lighting of the diffuse hits, and visibility of the light from them (by packets)
+	  - accumulate: the lit contributions are added to the colors of their camera rays
+	Each path carries the product of the coefficients of its ancestors (its throughput), so that the color of a
+	camera ray is the sum of the direct lighting at the hits of its tree multiplied by their throughput.
+	In deterministic mode the ray budget of each camera ray is applied as in getColor, but to the rays in breadth
+	first order: pruning by weight gives the same rays, but the max_rays cap may keep other branches.
+*/
+class Wavefront {
+public:
+	// Options of getColor
+	struct Settings {
+		int bounces;
+		bool fresnel, diffuse, deterministic;
+		real prune_weight; // Ray budget in deterministic mode
+		long max_rays;
+		bool bin; // Reorder the secondary rays for coherence
+		bool packets; // Trace the camera rays and the shadow rays by packets
+	};
+	
+	// Statistics of ray tree pruning in deterministic mode
+	struct Stats {
+		long traced = 0, pruned_weight = 0, pruned_cap = 0;
+	};
+	
+	Wavefront(const Settings &s) : settings(s) {}
+	
+	// Compute in colors[p] the sum of the colors of the samples of pixel p: rays contains the camera rays of the samples,
+	// pixel by pixel, or only one camera ray per pixel if same_rays (the samples then start from its closest hit).
+	// If raster is given, the closest hits of the camera rays are found with it.
+	void render(const Scene &scene, const std::vector<Ray> &rays, int samples, bool same_rays, Vector *colors, Stats &stats
+				, const SphereRaster *raster = nullptr);
+	
+private:
+	// Kinds of materials, shaded by separate loops
+	enum MaterialKind : unsigned char {DIFFUSE, REFLECTIVE, REFRACTIVE, N_KINDS};
+	static MaterialKind kind(const Material &mat) {
+		return mat.refraction > 0 ? REFRACTIVE : (mat.specularity > 0 ? REFLECTIVE : DIFFUSE);
+	}
+	
+	// Rays of the paths of one depth
+	struct PathQueue {
+		void clear();
+		void resize(unsigned n);
+		void push(const Vector &origin, const Vector &direction, const Vector &throughput, real weight, int depth, int sample);
+		unsigned size() const {return sample.size();}
+		Ray ray(unsigned k) const {return Ray(Vector(ox[k], oy[k], oz[k]), Vector(dx[k], dy[k], dz[k]));}
+		
+		std::vector<real> ox, oy, oz, dx, dy, dz;
+		std::vector<real> tr, tg, tb; // Throughput
+		std::vector<real> weight; // Weight of the ray for the budget (bound on its contribution to the color)
+		std::vector<int> depth; // Number of bounces left
+		std::vector<int> sample; // Index of the camera ray
+	};
+	
+	// Diffuse hits lit by the light if it is visible from them
+	struct ShadowQueue {
+		void clear();
+		void push(const Vector &P, const Vector &normal, real eps, const Vector &factor, int sample);
+		unsigned size() const {return sample.size();}
+		
+		std::vector<real> px, py, pz, nx, ny, nz, eps; // Surface at the hit
+		std::vector<real> fr, fg, fb; // Throughput of the path times the diffuse color at the hit
+		std::vector<real> lr, lg, lb; // Contribution if the light is visible, computed by the shadow stage
+		std::vector<int> sample;
+	};
+	
+	void generate(const std::vector<Ray> &rays, int samples, bool same_rays, int first, int last);
+	void bin();
+	void extend(const Scene &scene, bool primary, int shared_samples, const SphereRaster *raster);
+	void shade(const Scene &scene);
+	template <MaterialKind KIND>
+	void shadeKind(const Scene &scene, const unsigned *order, unsigned count);
+	void shadow(const Scene &scene);
+	void accumulate();
+	
+	Settings settings;
+	PathQueue paths, next; // Paths of the current depth, and of the next one being spawned
+	std::vector<Scene::Intersection> hits;
+	std::vector<Scene::Surface> surfaces;
+	std::vector<unsigned char> kinds; // Kind of material at each hit, N_KINDS for the paths which hit nothing
+	std::vector<unsigned> order; // Indices of the hit paths sorted by kind of material, or of the paths sorted by bin
+	std::vector<unsigned> bins; // Bin of each path
+	ShadowQueue shadows;
+	std::vector<unsigned char> visible;
+	std::vector<real> cr, cg, cb; // Color of each camera ray
+	std::vector<Scene::RayBudget> budgets; // Of each camera ray
+};
+
+#endif